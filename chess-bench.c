@@ -0,0 +1,395 @@
+/* Load generator for the chess module.
+ *
+ * Plays games on /dev/chess-N from many threads at once, one session
+ * (thread) per device, and reports the throughput and the p50/p99/p999
+ * latency of each command type. A command's latency is the time from
+ * its write() to the end of the read() of its reply.
+ *
+ * The player's moves are random picks among the best moves "06" finds,
+ * or come from a script file with one game per line, e.g.
+ *	WPe2-e4 WNg1-f3 WBf1-c4
+ * (a scripted game is played as white and ends when its moves run out).
+ *
+ * The module makes a single device unless it is loaded with devices=N,
+ * so load it with as many devices as sessions are wanted.
+ *
+ * Build with "make", see usage() for the options. */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SESSIONS	256
+#define MAX_SCRIPT	1024	/* Games read from a script */
+#define REPLY_SIZE	256
+
+/* Command types we time, indexed by the command number */
+#define N_CMDS	7
+static const char *cmd_names[N_CMDS] = { "00", "01", "02", "03", "04", "05", "06" };
+
+/* Latency samples of one command type in one session */
+struct samples {
+	uint64_t *ns;
+	size_t n;
+	size_t size;
+};
+
+struct session {
+	pthread_t thread;
+	int id;
+	int fd;
+	unsigned int seed;
+	struct samples lat[N_CMDS];
+	uint64_t games;
+	uint64_t moves;
+	uint64_t errors;	/* Unexpected replies and failed syscalls */
+};
+
+/* Options */
+static int n_sessions;
+static double duration = 10;	/* Seconds */
+static int max_plies = 40;	/* A game is abandoned after this many moves */
+static int move_time = -1;	/* "05 time=N" for every game, -1 leaves it */
+static int n_best = 3;		/* Random player moves come from "06 n_best" */
+static int view = 1;		/* "01" after every CPU move */
+
+static char *script[MAX_SCRIPT];
+static int script_len;
+
+static struct session sessions[MAX_SESSIONS];
+static volatile int stop;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add_sample(struct samples *s, uint64_t ns) {
+	if (s->n == s->size) {
+		s->size = s->size ? 2 * s->size : 1024;
+		s->ns = realloc(s->ns, s->size * sizeof(*s->ns));
+		if (!s->ns) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->ns[s->n++] = ns;
+}
+
+/* Send command c and read its reply into reply. Returns the length of
+ * the reply, or -1 if the device failed. */
+static int command(struct session *se, const char *c, char *reply) {
+	int type = (c[0] - '0') * 10 + (c[1] - '0');
+	size_t len = strlen(c);
+	uint64_t start = now_ns();
+	ssize_t n;
+
+	if (write(se->fd, c, len) != (ssize_t)len) {
+		++se->errors;
+		return -1;
+	}
+	n = read(se->fd, reply, REPLY_SIZE - 1);
+	if (n < 0) {
+		++se->errors;
+		return -1;
+	}
+	reply[n] = '\0';
+	if (type >= 0 && type < N_CMDS) {
+		add_sample(&se->lat[type], now_ns() - start);
+	}
+	return n;
+}
+
+static int game_over(const char *reply) {
+	return strcmp(reply, "MATE\n") == 0 || strcmp(reply, "STALEMATE\n") == 0;
+}
+
+static int move_ok(const char *reply) {
+	return strcmp(reply, "OK\n") == 0 || strcmp(reply, "CHECK\n") == 0 ||
+	       game_over(reply);
+}
+
+/* Pick the player's move from the lines of "06": one of the moves that
+ * follow "DEPTH d". Returns 0 if the player has no move. */
+static int pick_move(struct session *se, char *move) {
+	char c[16], reply[REPLY_SIZE];
+	char *lines[8];
+	int n = 0;
+
+	snprintf(c, sizeof(c), "06 %d\n", n_best);
+	if (command(se, c, reply) < 0) {
+		return 0;
+	}
+	char *save, *line = strtok_r(reply, "\n", &save);
+	if (!line || strncmp(line, "DEPTH", 5) != 0) {
+		++se->errors;
+		return 0;
+	}
+	while ((line = strtok_r(NULL, "\n", &save)) && n < 8) {
+		lines[n++] = line;
+	}
+	if (n == 0) {
+		return 0;
+	}
+	line = lines[rand_r(&se->seed) % n];
+	*strchrnul(line, ' ') = '\0';
+	strcpy(move, line);
+	return 1;
+}
+
+/* Play one game as color, with the player's moves from script if
+ * it is not NULL */
+static void play_game(struct session *se, char color, char *script_line) {
+	char c[64], reply[REPLY_SIZE], move[32];
+	char *save = NULL;
+	int ply;
+
+	snprintf(c, sizeof(c), "00 %c\n", color);
+	if (command(se, c, reply) < 0 || strcmp(reply, "OK\n") != 0) {
+		++se->errors;
+		return;
+	}
+	if (move_time >= 0) {
+		snprintf(c, sizeof(c), "05 time=%d\n", move_time);
+		command(se, c, reply);
+	}
+	for (ply = color == 'W' ? 0 : 1; ply < max_plies && !stop; ++ply) {
+		// Player's turn on even plies, the CPU's on odd ones
+		if (ply % 2 == 0) {
+			char *m;
+			if (script_line) {
+				m = strtok_r(save ? NULL : script_line, " \t\n", &save);
+				if (!m) {
+					break;
+				}
+			}
+			else {
+				if (!pick_move(se, move)) {
+					break;
+				}
+				m = move;
+			}
+			snprintf(c, sizeof(c), "02 %s\n", m);
+			if (command(se, c, reply) < 0) {
+				break;
+			}
+		}
+		else {
+			if (command(se, "03\n", reply) < 0) {
+				break;
+			}
+			if (view) {
+				char board[REPLY_SIZE];
+				command(se, "01\n", board);
+			}
+		}
+		if (!move_ok(reply)) {
+			++se->errors;
+			break;
+		}
+		++se->moves;
+		if (game_over(reply)) {
+			break;
+		}
+	}
+	++se->games;
+}
+
+static void *session_fn(void *arg) {
+	struct session *se = arg;
+	uint64_t game;
+
+	for (game = 0; !stop; ++game) {
+		if (script_len) {
+			// Every session goes through the script from a different game
+			char *line = strdup(script[(se->id + game) % script_len]);
+			play_game(se, 'W', line);
+			free(line);
+		}
+		else {
+			play_game(se, game % 2 ? 'B' : 'W', NULL);
+		}
+	}
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *ns, size_t n, double p) {
+	size_t i = (size_t)(p * (n - 1));
+	return ns[i] / 1000.0;
+}
+
+static void report(double elapsed) {
+	uint64_t games = 0, moves = 0, errors = 0, total = 0;
+	int i, t;
+
+	for (i = 0; i < n_sessions; ++i) {
+		games += sessions[i].games;
+		moves += sessions[i].moves;
+		errors += sessions[i].errors;
+	}
+	printf("%d sessions, %.1f s: %llu games, %llu moves (%.1f/s), %llu errors\n\n",
+	       n_sessions, elapsed, (unsigned long long)games,
+	       (unsigned long long)moves, moves / elapsed, (unsigned long long)errors);
+	printf("cmd %10s %10s %10s %10s %10s %10s\n",
+	       "count", "per sec", "p50 us", "p99 us", "p999 us", "max us");
+
+	for (t = 0; t < N_CMDS; ++t) {
+		size_t n = 0;
+		for (i = 0; i < n_sessions; ++i) {
+			n += sessions[i].lat[t].n;
+		}
+		if (n == 0) {
+			continue;
+		}
+		uint64_t *all = malloc(n * sizeof(*all));
+		if (!all) {
+			perror("malloc");
+			exit(1);
+		}
+		n = 0;
+		for (i = 0; i < n_sessions; ++i) {
+			memcpy(all + n, sessions[i].lat[t].ns, sessions[i].lat[t].n * sizeof(*all));
+			n += sessions[i].lat[t].n;
+		}
+		qsort(all, n, sizeof(*all), cmp_u64);
+		printf("%-3s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		       cmd_names[t], n, n / elapsed, percentile(all, n, 0.5),
+		       percentile(all, n, 0.99), percentile(all, n, 0.999), all[n - 1] / 1000.0);
+		total += n;
+		free(all);
+	}
+	printf("all %10llu %10.1f\n", (unsigned long long)total, total / elapsed);
+}
+
+static void read_script(const char *path) {
+	char line[4096];
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	while (script_len < MAX_SCRIPT && fgets(line, sizeof(line), f)) {
+		if (line[strspn(line, " \t\n")] != '\0' && line[0] != '#') {
+			script[script_len++] = strdup(line);
+		}
+	}
+	fclose(f);
+	if (!script_len) {
+		fprintf(stderr, "%s: no games\n", path);
+		exit(1);
+	}
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -n N     sessions, one thread on each of /dev/chess-0..N-1\n"
+		"           (default: every device that opens; load the module\n"
+		"           with devices=N to have N)\n"
+		"  -d SEC   run for SEC seconds (default 10)\n"
+		"  -p N     abandon a game after N moves (default 40)\n"
+		"  -t MS    send \"05 time=MS\" at the start of every game\n"
+		"  -b N     random player moves among the N best (1-5, default 3)\n"
+		"  -f FILE  play the player's moves from FILE, one game per line\n"
+		"  -q       no \"01\" after the CPU moves\n"
+		"  -s SEED  random seed (default: the time)\n", prog);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	unsigned int seed = time(NULL);
+	int max_sessions = MAX_SESSIONS;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:d:p:t:b:f:qs:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			max_sessions = atoi(optarg);
+			if (max_sessions < 1 || max_sessions > MAX_SESSIONS) {
+				usage(argv[0]);
+			}
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'p':
+			max_plies = atoi(optarg);
+			break;
+		case 't':
+			move_time = atoi(optarg);
+			break;
+		case 'b':
+			n_best = atoi(optarg);
+			if (n_best < 1 || n_best > 5) {
+				usage(argv[0]);
+			}
+			break;
+		case 'f':
+			read_script(optarg);
+			break;
+		case 'q':
+			view = 0;
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	// A session per device, so that replies are not taken by another thread
+	for (i = 0; i < max_sessions; ++i) {
+		char path[32];
+		snprintf(path, sizeof(path), "/dev/chess-%d", i);
+		int fd = open(path, O_RDWR);
+		if (fd < 0) {
+			if (max_sessions != MAX_SESSIONS) {
+				perror(path);
+				return 1;
+			}
+			break;
+		}
+		sessions[i].id = i;
+		sessions[i].fd = fd;
+		sessions[i].seed = seed + i;
+		++n_sessions;
+	}
+	if (!n_sessions) {
+		fprintf(stderr, "no /dev/chess-N device, is the module loaded?\n");
+		return 1;
+	}
+	if (n_sessions == 1 && max_sessions == MAX_SESSIONS) {
+		fprintf(stderr, "only /dev/chess-0, a single session: load the module "
+			"with devices=N to measure N at once\n");
+	}
+
+	uint64_t start = now_ns();
+	for (i = 0; i < n_sessions; ++i) {
+		if ((errno = pthread_create(&sessions[i].thread, NULL, session_fn, &sessions[i]))) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	struct timespec ts = { (time_t)duration, (long)((duration - (time_t)duration) * 1e9) };
+	nanosleep(&ts, NULL);
+	stop = 1;
+	for (i = 0; i < n_sessions; ++i) {
+		pthread_join(sessions[i].thread, NULL);
+		close(sessions[i].fd);
+	}
+	report((now_ns() - start) / 1e9);
+	return 0;
+}
@@ -0,0 +1,40 @@
+/* Generic netlink interface of the chess module, shared with userspace.
+ *
+ * The family "chess" runs the commands of /dev/chess-N without a file
+ * descriptor per game: every request names its game, the minor number
+ * N, in CHESS_ATTR_GAME, so one socket can drive all of them.
+ *
+ * A request is answered with a CHESS_CMD_REPLY message that carries
+ * CHESS_ATTR_GAME and the text the device would reply in
+ * CHESS_ATTR_REPLY, with the sequence number of the request.
+ * CHESS_CMD_CPU_MOVE is answered once the move is made, and until
+ * then the other requests for its game, except CHESS_CMD_VIEW, fail with
+ * EAGAIN instead of waiting. No reply comes if the game is reset
+ * through its device first. */
+#ifndef CHESS_NETLINK_H
+#define CHESS_NETLINK_H
+
+#define CHESS_GENL_NAME		"chess"
+#define CHESS_GENL_VERSION	1
+
+enum {
+	CHESS_CMD_UNSPEC,
+	CHESS_CMD_NEW,		/* "00", CHESS_ATTR_ARG is the player's color W/B */
+	CHESS_CMD_VIEW,		/* "01" */
+	CHESS_CMD_MOVE,		/* "02", CHESS_ATTR_ARG is the move, e.g. "WPe2-e4" */
+	CHESS_CMD_CPU_MOVE,	/* "03" */
+	CHESS_CMD_RESIGN,	/* "04" */
+	CHESS_CMD_REPLY,	/* Sent by the module */
+	__CHESS_CMD_MAX,
+};
+
+enum {
+	CHESS_ATTR_UNSPEC,
+	CHESS_ATTR_GAME,	/* u32 */
+	CHESS_ATTR_ARG,		/* NUL terminated string */
+	CHESS_ATTR_REPLY,	/* NUL terminated string */
+	__CHESS_ATTR_MAX,
+};
+#define CHESS_ATTR_MAX	(__CHESS_ATTR_MAX - 1)
+
+#endif
@@ -9,17 +9,53 @@ Instructor:	Lawrence Sebald
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/uaccess.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/slab.h>	/* for kmalloc() */
+#include <linux/mm.h>	/* for kvmalloc() */
 #include <linux/mutex.h>
+#include <linux/cache.h>
+#include <linux/random.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/sort.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>	/* for fatal_signal_pending() */
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/atomic.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/jiffies.h>
+#include <linux/cred.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/topology.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <linux/shrinker.h>
+#include <linux/memcontrol.h>
+#include <linux/sched/mm.h>	/* for set_active_memcg() */
+#include <linux/version.h>
+#include <linux/ctype.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/proc_fs.h>
+#include <net/genetlink.h>
+
+#include "chess-netlink.h"
 
 MODULE_LICENSE("GPL");
 
 #define DEVICE_NAME	"chess"
-#define MAX_MINOR	1
+#define MAX_MINOR	64	/* Most devices the devices parameter may ask for */
 
 /* Piece types */
 #define	PAWN	0
@@ -28,38 +64,214 @@ MODULE_LICENSE("GPL");
 #define	BISHOP	12
 #define	QUEEN	14
 #define	KING	15
+#define	CAPTURED	0x80	/* Or-ed into the type of a captured piece */
+
+#define ALIVE(p)	(!((p).type & CAPTURED))
+
+/* Square index of a coordinate known to be on the board */
+#define SQ(c)		(8 * (c).y + (c).x)
+
+/* Piece lists of a position, one per color and kind of piece,
+ * from the least valuable kind up */
+#define L_PAWN		0
+#define L_KNIGHT	1
+#define L_BISHOP	2
+#define L_ROOK		3
+#define L_QUEEN		4
+#define L_KING		5
+#define N_LISTS		6
+#define LIST_SIZE	10	/* Two pieces plus eight promoted pawns */
+
+/* Figure i of list l of color c */
+#define PIECE(pos, c, l, i)	(&(pos)->figures[(pos)->pieces[c][l][i]])
+
+/* The starting position, as load_position() reads it */
+#define START_FEN	"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w"
+#define FEN_SIZE	80	/* Longest FEN position_fen() writes, with the '\0' */
+
+/* How the game in the move log ended */
+#define RESULT_NONE	0	/* Not over, or abandoned */
+#define RESULT_WHITE	1
+#define RESULT_BLACK	2
+#define RESULT_DRAW	3
+
+/* Hash keys */
+#define ZOBRIST_SEED	0x9e3779b97f4a7c15ULL	/* Fixed, so that every load hashes alike */
+
+/* Search limits */
+#define MAX_PLY		32	/* Deepest line the search can follow */
+#define MAX_MOVES	256	/* More than the pseudo-legal moves in any position */
+#define INF		32000
+#define MATE		31000	/* Mate in n plies scores MATE - n */
+
+/* Moves are packed into 16 bits: from square (6), to square (6)
+ * and the piece type a pawn promotes to (4), 0 if none */
+typedef u16 move_t;
+#define MOVE(from, to, promo)	((move_t)((from) | ((to) << 6) | ((promo) << 12)))
+#define MOVE_FROM(m)		((m) & 63)
+#define MOVE_TO(m)		(((m) >> 6) & 63)
+#define MOVE_PROMO(m)		((m) >> 12)
+#define NO_MOVE			0
+
+/* Number of recent CPU move times kept for the latency percentiles */
+#define MOVE_SAMPLES	256
+
+/* Search features, each can be switched off per game with "05" */
+#define SEARCH_NULL		0x01	/* Null-move pruning */
+#define SEARCH_LMR		0x02	/* Late move reductions */
+#define SEARCH_PVS		0x04	/* Principal variation search */
+#define SEARCH_ASPIRATION	0x08	/* Aspiration windows at the root */
+#define SEARCH_ALL		0x0f
+
+#define ASPIRATION	50	/* Half width of the aspiration window */
+
+#define MAX_PV		5	/* Most lines "06" shows, so that they fit in a reply */
+
+/* Self-play ("07") */
+#define SELF_PLAY_RANDOM	4	/* Random plies that open each game, so that games differ */
+#define SELF_PLAY_PLIES		200	/* Default length limit of a game */
+
+/* Bench ("08") */
+#define BENCH_DEPTH	8	/* Default depth of the bench searches */
+
+/* Search budgets and slots */
+#define BUDGET_MIN_NODES	10000	/* Nodes a search gets over budget, enough for a few plies */
+#define UID_SLOTS		64	/* Users whose budgets are tracked at once */
+
+/* Latency histograms in debugfs */
+#define HIST_CMDS	9	/* "00" to "08" */
+#define HIST_BUCKETS	40	/* Bucket k counts times of 2^k to 2^(k+1) ns, the last one longer ones too */
+#define HIST_WAIT	0	/* Until the game lock is taken */
+#define HIST_RUN	1	/* From then until the reply */
+#define HIST_TOTAL	2
+#define HIST_PHASES	3
+
+/* Game images of chess-ctl */
+#define IMAGE_MAGIC	0x53534843	/* "CHSS" */
+#define IMAGE_VERSION	1
+
+/* Transposition table bound types */
+#define TT_EXACT	0
+#define TT_LOWER	1	/* Score is at least this (fail high) */
+#define TT_UPPER	2	/* Score is at most this (fail low) */
 
 typedef struct coord_t coord_t;
 typedef struct piece_t piece_t;
+typedef struct position_t position_t;
+
+struct undo_t;
+struct search_t;
+struct search_job;
+struct d_data;
+struct image_game;
+struct image_buf;
 
 /* Prototypes for device functions */
 static ssize_t	d_read(struct file *, char __user *, size_t, loff_t *);
 static ssize_t	d_write(struct file *, const char __user *, size_t, loff_t *);
 static int	d_open(struct inode *, struct file *);
 static int	d_release(struct inode *, struct file *);
+static __poll_t	d_poll(struct file *, poll_table *);
+
+/* Prototypes for the control device, chess-ctl */
+static ssize_t	image_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t	image_write(struct file *, const char __user *, size_t, loff_t *);
+static int	image_open(struct inode *, struct file *);
+static int	image_release(struct inode *, struct file *);
 
 /* Helper function prototypes */
 static void set_board(int);
 static void display_board(int);
 static int coord_to_sq(coord_t);
 static coord_t sq_to_coord(int);
-
-/* Choose a random legal move for the CPU */
-static int make_move(int, char, int);
-/* Fills an array with all legal moves for a given piece */
-static int find_move(int, coord_t*, piece_t);
-static int pawn_helper(int, coord_t*, int, piece_t);
-static int verify_move_helper(int, coord_t, char);
-static int knight_helper(int, coord_t*, int, piece_t);
-static int rook_helper(int, coord_t*, int, piece_t);
-static int bishop_helper(int, coord_t*, int, piece_t);
-static int queen_helper(int, coord_t*, int, piece_t);
-static int king_helper(int, coord_t*, int, piece_t);
+static int set_option(int, char *);
+
+/* Find any legal move for the CPU (used to detect checkmate) */
+static int make_move(position_t *, char, int);
+/* Move generation over the piece lists */
+static int gen_pawn_moves(position_t *, int, move_t *, int);
+static int gen_leaper_moves(position_t *, int, int, const u64 *, move_t *, int);
+static int gen_slider_moves(position_t *, int, int, int, int, move_t *, int);
+static void init_tables(void);
+static u64 xorshift64(u64 *);
+static void init_zobrist(void);
 
 /* Verify that player made a valid move */
-static int move_valid(int, piece_t, coord_t, int, int, piece_t, piece_t);
-
-static int in_check(int, char);
+static move_t move_valid(position_t *, piece_t, coord_t, int, int, piece_t, piece_t);
+
+static int in_check(position_t *, char);
+static int find_attacker(position_t *, int, int, int, u64, u32);
+
+/* Make and take back moves on a position */
+static void do_move(position_t *, move_t, struct undo_t *);
+static void undo_move(position_t *, struct undo_t *);
+static void plist_add(position_t *, int, int, int);
+static void plist_remove(position_t *, int, int, int);
+static void plist_restore(position_t *, int, int, int);
+static int gen_moves(position_t *, char, move_t *);
+static int move_legal(position_t *, char, move_t);
+static void init_position(position_t *, char);
+static char load_position(position_t *, const char *);
+static int position_fen(position_t *, char, char *);
+static int legal_moves(position_t *, char, move_t *);
+
+/* Engine search (alpha-beta with a transposition table) */
+static int evaluate(position_t *, char);
+static void order_moves(position_t *, move_t *, int *, int, move_t);
+static int tt_score_to(int, int);
+static int tt_score_from(int, int);
+static int see(position_t *, move_t);
+static int count_node(struct search_t *);
+static int alphabeta(struct search_t *, char, int, int, int, int, int);
+static int has_pieces(position_t *, int);
+static int search_iteration(struct search_t *, int);
+static int multipv_iteration(struct search_t *, int);
+static void iterate(struct search_t *);
+static int engine_alloc(int);
+static unsigned long engine_free(int);
+static int sched_acquire(kuid_t);
+static int sched_try_acquire(void);
+static void sched_release(void);
+static void pool_push(int, struct search_job *);
+static int pool_thread(void *);
+static u64 budget_allowance(int);
+static void budget_charge(int, u64);
+static int search_slot(int, unsigned int);
+static void pool_search(int, struct search_t *);
+static int think(int, char, move_t *, int);
+static void start_ponder(int);
+static void stop_ponder(int);
+static void reset_search(int);
+static void queue_game_work(int, struct work_struct *);
+static void set_game_node(int, int);
+static void set_game_memcg(int);
+static enum hrtimer_restart deadline_fn(struct hrtimer *);
+static void record_move_time(int, ktime_t);
+static void hist_record(int, ktime_t, ktime_t, ktime_t);
+static void log_reset(int, const char *);
+static void log_move(int, move_t);
+static void set_result(int, char);
+static void game_stuck(int, char);
+static int wait_search(int);
+static int cpu_move(int);
+static int move_text(position_t *, move_t, char *);
+static int move_san(position_t *, char, move_t, char *);
+static int analyse(int, int);
+static move_t random_move(position_t *, char);
+static int self_play(int, int, int);
+static int bench(int, int);
+static void queue_move_work(int, u8, struct genl_info *);
+static void move_work_fn(struct work_struct *);
+static void command_done(int);
+static void publish(int, int);
+static void view_board(int);
+static int view_request(const char *, size_t);
+static int reply_ready(struct d_data *);
+static ssize_t run_command(int, char *, size_t, int, struct genl_info *, char *);
+static int nl_send(u32, u32, int, const char *);
+static int image_load_game(const struct image_game *, position_t *);
+static void image_restore_game(const struct image_game *);
+static int image_import(struct image_buf *);
 
 /* This structure holds the addresses of functions
 *  that perform device operations.*/
@@ -68,50 +280,314 @@ static const struct file_operations fops = {
 	.read	= d_read,
 	.write	= d_write,
 	.open	= d_open,
-	.release = d_release
+	.release = d_release,
+	.poll	= d_poll
 };
 
 struct coord_t {
-	int x; /* x - row (letters), y - column (numbers);
+	s8 x; /* x - row (letters), y - column (numbers);
 		both 0 through 7 */
-	int y;
+	s8 y;
 };
 
+/* Kept to 4 bytes so that all 32 pieces fit in two cache lines */
 struct piece_t {
-	int type; /* 0 - pawn, 8 - rook, 10 - knight
-		12 - bishop, 14 - queen, 15 - king */
+	u8 type; /* 0 - pawn, 8 - rook, 10 - knight
+		12 - bishop, 14 - queen, 15 - king,
+		CAPTURED is set once the piece is taken */
 	char color; /* W/B */
-	int alive; /* 0 - dead, 1 - alive */
 	coord_t square; /* coordinate of form (x, y)
 			E4 would be (4, 3) */
 };
 
-struct d_data {
-	struct cdev cdev;
-	int game_on;	/* Is a game in progress? */
-	int board[64];	/* Stores indexes of the figure array
+/* 384 bytes: the key, occupancy and board share the first cache line */
+struct position_t {
+	u64 key;	/* Zobrist hash, includes the side to move */
+	u64 occ[2];	/* Squares taken by white/black pieces, bit n is square n */
+	s8 board[64];	/* Stores indexes of the figure array
 			or -1 if the square is empty */
 	piece_t figures[32]; /* Store the information about the pieces
 				first 16 are white, other 16 are black
 				first 8 are pawns, then 2 rooks,
 				2 knights, 2 bishops, a queen, and a king.*/
+	u8 pieces[2][N_LISTS][LIST_SIZE];	/* Figures that are still on the board
+						by color and kind, promoted pawns
+						are on the list of their new kind */
+	u8 count[2][N_LISTS];	/* Length of each list */
+	u8 list_pos[32];	/* Where each figure is in its list */
+};
+
+/* Everything needed to take a move back */
+struct undo_t {
+	u64 key;
+	move_t move;
+	s8 captured;	/* Index of the captured figure or -1 */
+	u8 promoted;
+	u8 pawn_pos;	/* Place of a promoted pawn in the pawn list */
+};
+
+struct tt_entry {
+	u64 key;
+	s16 score;
+	move_t move;	/* Best move found in this position */
+	s8 depth;
+	u8 flag;	/* TT_EXACT/TT_LOWER/TT_UPPER */
+};
+
+/* Where a node of the search goes on when alphabeta() gets back to it */
+enum {
+	FRAME_ENTER,		/* New node */
+	FRAME_NULL_DONE,	/* Back from the null move search */
+	FRAME_MOVES,		/* Generate the moves */
+	FRAME_NEXT,		/* Search the next legal move */
+	FRAME_REDUCED_DONE,	/* Back from the first search of a later move */
+	FRAME_FULL_DONE,	/* Back from the unreduced search of a reduced move */
+	FRAME_MOVE_DONE,	/* Back from the last search of a move */
+	FRAME_END,		/* All moves searched or a cutoff */
+	FRAME_QUIESCE,		/* New quiescence node */
+	FRAME_QUIESCE_NEXT,	/* Search the next capture */
+	FRAME_QUIESCE_DONE,	/* Back from the search of a capture */
+};
+
+/* What a node of the search keeps while its children are searched */
+struct search_frame {
+	int alpha;
+	int beta;
+	int old_alpha;	/* alpha on entry, to tell the hash table flag */
+	int best;
+	int depth;
+	int n;		/* Moves in s->moves[ply] */
+	int k;		/* The move being searched */
+	int legal;	/* Legal moves so far */
+	int b;		/* Beta of the first search of a later move */
+	move_t hash_move;
+	move_t best_move;
+	u8 state;	/* FRAME_* */
+	u8 null_ok;
+	u8 check;	/* Side to move is in check */
+	u8 reduce;	/* Plies the move is reduced by */
+	char color;	/* Side to move */
+};
+
+/* State of one search. The search works on its own copy of the
+ * board so that it can run without holding the game lock. */
+struct search_t {
+	position_t pos;
+	struct tt_entry *tt;
+	unsigned long tt_mask;
+	int stop;		/* Set to abandon the search */
+	struct hrtimer timer;	/* Sets stop when the move time is used up */
+	u64 nodes;
+	u64 max_nodes;		/* The search stops once it has searched this many */
+	char color;		/* Side to move at the root */
+	int max_depth;
+	u8 features;		/* SEARCH_* flags */
+	move_t root_best;	/* Best root move of the current iteration */
+	move_t best;		/* Best root move of the last finished iteration */
+	int score;
+	int depth;		/* Depth of the last finished iteration */
+	int multipv;		/* Number of best root moves "06" asks for, 0 for a move */
+	int pv_count;
+	move_t pv_moves[MAX_PV];	/* Best root moves of the last finished iteration, best first */
+	int pv_scores[MAX_PV];
+	move_t moves[MAX_PLY][MAX_MOVES];
+	int scores[MAX_PLY][MAX_MOVES];	/* Move ordering scores */
+	struct undo_t undo[MAX_PLY];
+	struct search_frame frames[MAX_PLY];	/* The search's stack, see alphabeta() */
+};
+
+/* A search run by the pool of search threads */
+struct search_job {
+	struct list_head list;	/* On the deque of a search thread */
+	struct search_t *s;
+	struct completion done;
+};
+
+/* Per-device state. What a command or the search set-up touches sits
+ * at the front next to the board, the rest follows on its own cache
+ * lines. Each device starts on a new cache line so that games played
+ * on different CPUs do not share any. */
+struct d_data {
+	struct mutex lock;	/* Protects everything below */
+	position_t pos;	/* Board and pieces */
 	char turn;	/* W/B */
 	char player_color;
 	char computer_color;
-	char reply[130];	/* Store the most recent reply */
-};
+	u8 game_on;	/* Is a game in progress? */
+	u8 searching;		/* "03" is thinking, with the lock dropped */
+	u8 ponder;		/* Think on the player's time? */
+	u8 pondering;		/* A ponder search is queued or running, until "03" takes it over */
+	u8 features;		/* SEARCH_* flags of this game's searches */
+	unsigned int generation;	/* Bumped by "00" to cancel a running search */
+	int move_time;		/* Time budget of a CPU move in ms, 0 for none */
+	u64 ponder_key;		/* Position the ponder search is working on */
+	struct search_t *search;	/* Used by "03" and by the ponder worker */
+	struct tt_entry *tt;	/* Transposition table, allocated on first search */
+	unsigned long tt_mask;
+	int node;		/* NUMA node of the search memory and workers */
+	struct mem_cgroup *memcg;	/* Charged for the game's memory, that of the task that started it */
+	unsigned long last_used;	/* jiffies of the last command, for the shrinker */
+	kuid_t uid;		/* User charged for the searches, who sent the last command */
+	u64 budget_used;	/* Nodes searched in the current budget window */
+	unsigned long budget_start;	/* jiffies when the window began */
+
+	/* Rarely used */
+	struct cdev cdev ____cacheline_aligned_in_smp;
+	wait_queue_head_t wq;	/* Woken up when searching drops to 0 */
+	wait_queue_head_t reply_wq;	/* Woken up when a command finishes */
+	atomic_t pending;	/* Commands written but not finished yet */
+	struct search_job ponder_job;
+	struct work_struct move_work;	/* "03", "06", "07" or "08" written with O_NONBLOCK or sent over netlink */
+	u8 work_cmd;		/* Which of them is queued */
+	int work_arg[2];	/* and its arguments */
+	u32 work_portid;	/* Netlink socket that gets its reply, 0 if written to the device */
+	u32 work_seq;		/* and the sequence number of the request */
+	ktime_t work_start;	/* When it was queued */
+	int users;		/* Open file descriptors */
+
+	/* Moves of the game so far, streamed by the pgn file in debugfs */
+	move_t *log;
+	u32 log_len;
+	u32 log_size;		/* Moves the log has room for */
+	u8 log_full;		/* A move could not be logged, the log stops there */
+	u8 result;		/* RESULT_* */
+	u8 self_play;		/* The log is of a "07" game */
+	char *log_fen;		/* Position the log starts from, NULL for the usual one */
+	char reply[130];	/* Reply of the command being run */
+
+	/* What readers see. They copy it under snap_lock without taking
+	the game lock, so that they never wait for a search */
+	seqlock_t snap_lock;
+	char snap_reply[130];	/* Reply of the last finished command */
+	char snap_board[130];	/* The board as "01" shows it */
+	unsigned long reply_seq;	/* Bumped for every new snap_reply, 0 for "NOMSG" */
+	unsigned long read_seq;	/* reply_seq of the last reply read */
+
+	/* Statistics, see stats_show() */
+	u64 cpu_moves;
+	u64 ponder_hits;
+	u64 nodes;
+	u32 move_us[MOVE_SAMPLES];	/* Recent CPU move times in microseconds */
+} ____cacheline_aligned_in_smp;
 
 /* Global variables */
 static int major = 0;
 static struct d_data cdev_data[MAX_MINOR];
 static struct class *cdev_class = NULL;
-static DEFINE_MUTEX(d_mutex);
+static struct workqueue_struct *chess_wq = NULL;	/* Runs non-blocking commands */
+
+/* Zobrist keys, indexed by color, piece type and square */
+static u64 zobrist[2][16][64];
+static u64 zobrist_side;	/* Black to move */
+
+/* Ray directions as (x, y) steps: four rook directions, then four bishop ones */
+static const int dir_x[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+static const int dir_y[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+
+/* Attack tables, filled in once by init_tables() */
+static u64 knight_attacks[64];
+static u64 king_attacks[64];
+static u64 pawn_attacks[2][64];	/* Indexed by the color of the pawn */
+static u64 rook_lines[64];	/* Squares a rook reaches on an empty board */
+static u64 bishop_lines[64];
+static u8 rays[64][8][7];	/* Squares in each direction, nearest first */
+static u8 ray_len[64][8];
+static u64 between[64][64];	/* Squares strictly between two squares on a line */
+
+/* Module parameters */
+static int devices = 1;
+module_param(devices, int, 0444);
+MODULE_PARM_DESC(devices, "Number of /dev/chess-N devices, each playing one game (1 to 64)");
+
+static int search_depth = 8;
+module_param(search_depth, int, 0644);
+MODULE_PARM_DESC(search_depth, "Maximum depth of the CPU move search in plies");
+
+static int move_time = 1000;
+module_param(move_time, int, 0444);
+MODULE_PARM_DESC(move_time, "Default time budget of a CPU move in ms, 0 to search to full depth");
+
+static int hash_kb = 1024;
+module_param(hash_kb, int, 0444);
+MODULE_PARM_DESC(hash_kb, "Transposition table size per game in KB");
+
+static bool ponder = false;
+module_param(ponder, bool, 0444);
+MODULE_PARM_DESC(ponder, "Search on the player's time in new games by default");
+
+static bool numa = true;
+module_param(numa, bool, 0444);
+MODULE_PARM_DESC(numa, "Keep each game's search memory and workers on the NUMA node that started it");
+
+static int max_searches = 0;
+module_param(max_searches, int, 0644);
+MODULE_PARM_DESC(max_searches, "Most CPU searches run at once, the others wait their turn; 0 for one per search thread");
+
+static int budget_window = 10000;
+module_param(budget_window, int, 0644);
+MODULE_PARM_DESC(budget_window, "Length of the search budget window in ms");
+
+static ulong game_budget = 0;
+module_param(game_budget, ulong, 0644);
+MODULE_PARM_DESC(game_budget, "Nodes a game may search per budget window at full strength, 0 for no limit");
+
+static ulong uid_budget = 0;
+module_param(uid_budget, ulong, 0644);
+MODULE_PARM_DESC(uid_budget, "Nodes the games of one user may search per budget window at full strength, 0 for no limit");
 
 static int cdev_uevent(struct device *dev, struct kobj_uevent_env *env) {
 	add_uevent_var(env, "DEVMODE=%#o", 0666);
 	return 0;
 }
 
+static int cmp_u32(const void *a, const void *b) {
+	u32 x = *(const u32 *)a;
+	u32 y = *(const u32 *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Engine statistics of one device, in /sys/class/chess/chess-N/stats.
+ * Percentiles are over the last MOVE_SAMPLES CPU moves. */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct d_data *game = dev_get_drvdata(dev);
+	u64 cpu_moves, ponder_hits, nodes;
+	u32 p50 = 0, p99 = 0;
+	int node;
+	u32 *samples;
+	int n;
+
+	samples = kmalloc_array(MOVE_SAMPLES, sizeof(*samples), GFP_KERNEL);
+	if (!samples) {
+		return -ENOMEM;
+	}
+	mutex_lock(&game->lock);
+	cpu_moves = game->cpu_moves;
+	ponder_hits = game->ponder_hits;
+	nodes = game->nodes;
+	node = game->node;
+	n = min_t(u64, cpu_moves, MOVE_SAMPLES);
+	memcpy(samples, game->move_us, n * sizeof(*samples));
+	mutex_unlock(&game->lock);
+
+	if (n > 0) {
+		sort(samples, n, sizeof(*samples), cmp_u32, NULL);
+		p50 = samples[DIV_ROUND_UP(50 * n, 100) - 1];
+		p99 = samples[DIV_ROUND_UP(99 * n, 100) - 1];
+	}
+	kfree(samples);
+
+	return sysfs_emit(buf, "cpu_moves %llu\nponder_hits %llu\nnodes %llu\n"
+			  "p50_move_us %u\np99_move_us %u\nnode %d\n",
+			  cpu_moves, ponder_hits, nodes, p50, p99, node);
+}
+static DEVICE_ATTR_RO(stats);
+
+static struct attribute *chess_attrs[] = {
+	&dev_attr_stats.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(chess);
+
 /* Helper procedures to convert between coordinates and squares */
 static int coord_to_sq(coord_t c) {
 	if (c.x < 0 || c.x > 7 || c.y < 0 || c.y > 7) {
@@ -132,58 +608,132 @@ static coord_t sq_to_coord(int s) {
 	return c;
 }
 
-/* Display current state of the board */
+/* Build the attack and ray tables. This is the only place that
+ * checks for the edge of the board: move generation and attack
+ * detection just walk the tables. */
+static void init_tables(void) {
+	static const int knight_x[8] = { 1, 2, 2, 1, -1, -2, -2, -1 };
+	static const int knight_y[8] = { 2, 1, -1, -2, -2, -1, 1, 2 };
+	int sq, d;
+
+	for (sq = 0; sq < 64; ++sq) {
+		coord_t from = sq_to_coord(sq);
+		coord_t c;
+		for (d = 0; d < 8; ++d) {
+			c.x = from.x + knight_x[d];
+			c.y = from.y + knight_y[d];
+			if (coord_to_sq(c) != -1) {
+				knight_attacks[sq] |= BIT_ULL(coord_to_sq(c));
+			}
+			c.x = from.x + dir_x[d];
+			c.y = from.y + dir_y[d];
+			if (coord_to_sq(c) != -1) {
+				king_attacks[sq] |= BIT_ULL(coord_to_sq(c));
+			}
+
+			// Walk the ray, everything passed so far is in between
+			u64 passed = 0;
+			for (; coord_to_sq(c) != -1; c.x += dir_x[d], c.y += dir_y[d]) {
+				int to = coord_to_sq(c);
+				between[sq][to] = passed;
+				rays[sq][d][ray_len[sq][d]++] = to;
+				passed |= BIT_ULL(to);
+			}
+			if (d < 4) {
+				rook_lines[sq] |= passed;
+			}
+			else {
+				bishop_lines[sq] |= passed;
+			}
+		}
+		// Pawns take one square diagonally forward
+		for (d = -1; d <= 1; d += 2) {
+			c.x = from.x + d;
+			c.y = from.y + 1;
+			if (coord_to_sq(c) != -1) {
+				pawn_attacks[0][sq] |= BIT_ULL(coord_to_sq(c));
+			}
+			c.y = from.y - 1;
+			if (coord_to_sq(c) != -1) {
+				pawn_attacks[1][sq] |= BIT_ULL(coord_to_sq(c));
+			}
+		}
+	}
+}
+
+// Next number of a xorshift64* generator with state *x
+static u64 xorshift64(u64 *x) {
+	*x ^= *x >> 12;
+	*x ^= *x << 25;
+	*x ^= *x >> 27;
+	return *x * 0x2545f4914f6cdd1dULL;
+}
+
+/* Fill the Zobrist keys from a fixed seed, not from get_random_bytes():
+ * every load then hashes positions alike and fills the same hash table
+ * slots, so "08" counts the same nodes and its signatures can be
+ * compared across loads and builds. */
+static void init_zobrist(void) {
+	u64 x = ZOBRIST_SEED;
+	u64 *key = &zobrist[0][0][0];
+	int i;
+
+	for (i = 0; i < sizeof(zobrist) / sizeof(*key); ++i) {
+		key[i] = xorshift64(&x);
+	}
+	zobrist_side = xorshift64(&x);
+}
+
+/* Render the current state of the board into snap_board. Called with
+ * the game lock held and snap_lock taken for writing */
 static void display_board(int d_num) {
-	mutex_lock(&d_mutex);
 	int i;
 	for (i = 0; i < 128; i = i + 2) {
 		int piece_index;
-		piece_index = cdev_data[d_num].board[i / 2];
+		piece_index = cdev_data[d_num].pos.board[i / 2];
 
 		/* Empty square */
 		if (piece_index == -1) {
-			cdev_data[d_num].reply[i] = '*';
-			cdev_data[d_num].reply[i + 1] = '*';
+			cdev_data[d_num].snap_board[i] = '*';
+			cdev_data[d_num].snap_board[i + 1] = '*';
 		}
 		/* An occupied square */
 		else {
 			/* Determine piece color */
-			if (cdev_data[d_num].figures[piece_index].color == 'W') {
-				cdev_data[d_num].reply[i] = 'W';
+			if (cdev_data[d_num].pos.figures[piece_index].color == 'W') {
+				cdev_data[d_num].snap_board[i] = 'W';
 			}
 			else {
-				cdev_data[d_num].reply[i] = 'B';
+				cdev_data[d_num].snap_board[i] = 'B';
 			}
 
-			if (cdev_data[d_num].figures[piece_index].type == PAWN) {
-				cdev_data[d_num].reply[i + 1] = 'P';
+			if (cdev_data[d_num].pos.figures[piece_index].type == PAWN) {
+				cdev_data[d_num].snap_board[i + 1] = 'P';
 			}
-			else if (cdev_data[d_num].figures[piece_index].type == ROOK) {
-				cdev_data[d_num].reply[i + 1] = 'R';
+			else if (cdev_data[d_num].pos.figures[piece_index].type == ROOK) {
+				cdev_data[d_num].snap_board[i + 1] = 'R';
 			}
-			else if (cdev_data[d_num].figures[piece_index].type == KNIGHT) {
-				cdev_data[d_num].reply[i + 1] = 'N';
+			else if (cdev_data[d_num].pos.figures[piece_index].type == KNIGHT) {
+				cdev_data[d_num].snap_board[i + 1] = 'N';
 			}
-			else if (cdev_data[d_num].figures[piece_index].type == BISHOP) {
-				cdev_data[d_num].reply[i + 1] = 'B';
+			else if (cdev_data[d_num].pos.figures[piece_index].type == BISHOP) {
+				cdev_data[d_num].snap_board[i + 1] = 'B';
 			}
-			else if (cdev_data[d_num].figures[piece_index].type == QUEEN) {
-				cdev_data[d_num].reply[i + 1] = 'Q';
+			else if (cdev_data[d_num].pos.figures[piece_index].type == QUEEN) {
+				cdev_data[d_num].snap_board[i + 1] = 'Q';
 			}
 			else {
-				cdev_data[d_num].reply[i + 1] = 'K';
+				cdev_data[d_num].snap_board[i + 1] = 'K';
 			}
 		}
 	}
-	cdev_data[d_num].reply[i++] = '\n';
-	cdev_data[d_num].reply[i] = '\0';
-
-	mutex_unlock(&d_mutex);
+	cdev_data[d_num].snap_board[i++] = '\n';
+	cdev_data[d_num].snap_board[i] = '\0';
 }
 
 /* Perform initial board set-up */
 static void set_board(int d_num) {
-	mutex_lock(&d_mutex);
+	mutex_lock(&cdev_data[d_num].lock);
 
 	cdev_data[d_num].game_on = 1;
 	cdev_data[d_num].turn = 'W';
@@ -192,66 +742,60 @@ static void set_board(int d_num) {
 	/* Fill in the pawns */
 	for (i = 0; i < 8; ++i) {
 		/* White */
-		cdev_data[d_num].figures[i].type = PAWN;
-		cdev_data[d_num].figures[i].color = 'W';
-		cdev_data[d_num].figures[i].alive = 1;
-		cdev_data[d_num].figures[i].square.x = i;
-		cdev_data[d_num].figures[i].square.y = 1;
+		cdev_data[d_num].pos.figures[i].type = PAWN;
+		cdev_data[d_num].pos.figures[i].color = 'W';
+		cdev_data[d_num].pos.figures[i].square.x = i;
+		cdev_data[d_num].pos.figures[i].square.y = 1;
 
 		int square;
-		square = coord_to_sq(cdev_data[d_num].figures[i].square);
-		cdev_data[d_num].board[square] = i;
+		square = coord_to_sq(cdev_data[d_num].pos.figures[i].square);
+		cdev_data[d_num].pos.board[square] = i;
 
 		/* Black */
 		int j;
 		j = i + 16; /* Offset in the array */
-		cdev_data[d_num].figures[j].type = PAWN;
-		cdev_data[d_num].figures[j].color = 'B';
-		cdev_data[d_num].figures[j].alive = 1;
-		cdev_data[d_num].figures[j].square.x = i;
-		cdev_data[d_num].figures[j].square.y = 6;
+		cdev_data[d_num].pos.figures[j].type = PAWN;
+		cdev_data[d_num].pos.figures[j].color = 'B';
+		cdev_data[d_num].pos.figures[j].square.x = i;
+		cdev_data[d_num].pos.figures[j].square.y = 6;
 
-		square = coord_to_sq(cdev_data[d_num].figures[j].square);
-		cdev_data[d_num].board[square] = j;
+		square = coord_to_sq(cdev_data[d_num].pos.figures[j].square);
+		cdev_data[d_num].pos.board[square] = j;
 	}
 
 	/* Fill in the rooks */
 	int w = 8;
 	int square_w = 0;
 
-	cdev_data[d_num].figures[w].type = ROOK;
-	cdev_data[d_num].figures[w].color = 'W';
-	cdev_data[d_num].figures[w].alive = 1;
-	cdev_data[d_num].figures[w].square.x = 0;
-	cdev_data[d_num].figures[w].square.y = 0;
-	cdev_data[d_num].board[square_w] = w;
+	cdev_data[d_num].pos.figures[w].type = ROOK;
+	cdev_data[d_num].pos.figures[w].color = 'W';
+	cdev_data[d_num].pos.figures[w].square.x = 0;
+	cdev_data[d_num].pos.figures[w].square.y = 0;
+	cdev_data[d_num].pos.board[square_w] = w;
 
 	int b = i + 16;
 	int square_b = square_w + 56;
 
-	cdev_data[d_num].figures[b].type = ROOK;
-	cdev_data[d_num].figures[b].color = 'B';
-	cdev_data[d_num].figures[b].alive = 1;
-	cdev_data[d_num].figures[b].square.x = 0;
-	cdev_data[d_num].figures[b].square.y = 7;
-	cdev_data[d_num].board[square_b] = b;
+	cdev_data[d_num].pos.figures[b].type = ROOK;
+	cdev_data[d_num].pos.figures[b].color = 'B';
+	cdev_data[d_num].pos.figures[b].square.x = 0;
+	cdev_data[d_num].pos.figures[b].square.y = 7;
+	cdev_data[d_num].pos.board[square_b] = b;
 
 	++w;
 	++b;
 
-	cdev_data[d_num].figures[w].type = ROOK;
-	cdev_data[d_num].figures[w].color = 'W';
-	cdev_data[d_num].figures[w].alive = 1;
-	cdev_data[d_num].figures[w].square.x = 7;
-	cdev_data[d_num].figures[w].square.y = 0;
-	cdev_data[d_num].board[square_w + 7] = w;
+	cdev_data[d_num].pos.figures[w].type = ROOK;
+	cdev_data[d_num].pos.figures[w].color = 'W';
+	cdev_data[d_num].pos.figures[w].square.x = 7;
+	cdev_data[d_num].pos.figures[w].square.y = 0;
+	cdev_data[d_num].pos.board[square_w + 7] = w;
 
-	cdev_data[d_num].figures[b].type = ROOK;
-	cdev_data[d_num].figures[b].color = 'B';
-	cdev_data[d_num].figures[b].alive = 1;
-	cdev_data[d_num].figures[b].square.x = 7;
-	cdev_data[d_num].figures[b].square.y = 7;
-	cdev_data[d_num].board[square_b + 7] = b;
+	cdev_data[d_num].pos.figures[b].type = ROOK;
+	cdev_data[d_num].pos.figures[b].color = 'B';
+	cdev_data[d_num].pos.figures[b].square.x = 7;
+	cdev_data[d_num].pos.figures[b].square.y = 7;
+	cdev_data[d_num].pos.board[square_b + 7] = b;
 
 
 	/* Fill in the knights */
@@ -260,36 +804,32 @@ static void set_board(int d_num) {
 	++square_w;
 	++square_b;
 
-	cdev_data[d_num].figures[w].type = KNIGHT;
-	cdev_data[d_num].figures[w].color = 'W';
-	cdev_data[d_num].figures[w].alive = 1;
-	cdev_data[d_num].figures[w].square.x = 1;
-	cdev_data[d_num].figures[w].square.y = 0;
-	cdev_data[d_num].board[square_w] = w;
+	cdev_data[d_num].pos.figures[w].type = KNIGHT;
+	cdev_data[d_num].pos.figures[w].color = 'W';
+	cdev_data[d_num].pos.figures[w].square.x = 1;
+	cdev_data[d_num].pos.figures[w].square.y = 0;
+	cdev_data[d_num].pos.board[square_w] = w;
 
-	cdev_data[d_num].figures[b].type = KNIGHT;
-	cdev_data[d_num].figures[b].color = 'B';
-	cdev_data[d_num].figures[b].alive = 1;
-	cdev_data[d_num].figures[b].square.x = 1;
-	cdev_data[d_num].figures[b].square.y = 7;
-	cdev_data[d_num].board[square_b] = b;
+	cdev_data[d_num].pos.figures[b].type = KNIGHT;
+	cdev_data[d_num].pos.figures[b].color = 'B';
+	cdev_data[d_num].pos.figures[b].square.x = 1;
+	cdev_data[d_num].pos.figures[b].square.y = 7;
+	cdev_data[d_num].pos.board[square_b] = b;
 
 	++w;
 	++b;
 
-	cdev_data[d_num].figures[w].type = KNIGHT;
-	cdev_data[d_num].figures[w].color = 'W';
-	cdev_data[d_num].figures[w].alive = 1;
-	cdev_data[d_num].figures[w].square.x = 6;
-	cdev_data[d_num].figures[w].square.y = 0;
-	cdev_data[d_num].board[square_w + 5] = w;
+	cdev_data[d_num].pos.figures[w].type = KNIGHT;
+	cdev_data[d_num].pos.figures[w].color = 'W';
+	cdev_data[d_num].pos.figures[w].square.x = 6;
+	cdev_data[d_num].pos.figures[w].square.y = 0;
+	cdev_data[d_num].pos.board[square_w + 5] = w;
 
-	cdev_data[d_num].figures[b].type = KNIGHT;
-	cdev_data[d_num].figures[b].color = 'B';
-	cdev_data[d_num].figures[b].alive = 1;
-	cdev_data[d_num].figures[b].square.x = 6;
-	cdev_data[d_num].figures[b].square.y = 7;
-	cdev_data[d_num].board[square_b + 5] = b;
+	cdev_data[d_num].pos.figures[b].type = KNIGHT;
+	cdev_data[d_num].pos.figures[b].color = 'B';
+	cdev_data[d_num].pos.figures[b].square.x = 6;
+	cdev_data[d_num].pos.figures[b].square.y = 7;
+	cdev_data[d_num].pos.board[square_b + 5] = b;
 
 	/* Fill in the bishops */
 	++w;
@@ -297,36 +837,32 @@ static void set_board(int d_num) {
 	++square_w;
 	++square_b;
 
-	cdev_data[d_num].figures[w].type = BISHOP;
-	cdev_data[d_num].figures[w].color = 'W';
-	cdev_data[d_num].figures[w].alive = 1;
-	cdev_data[d_num].figures[w].square.x = 2;
-	cdev_data[d_num].figures[w].square.y = 0;
-	cdev_data[d_num].board[square_w] = w;
+	cdev_data[d_num].pos.figures[w].type = BISHOP;
+	cdev_data[d_num].pos.figures[w].color = 'W';
+	cdev_data[d_num].pos.figures[w].square.x = 2;
+	cdev_data[d_num].pos.figures[w].square.y = 0;
+	cdev_data[d_num].pos.board[square_w] = w;
 
-	cdev_data[d_num].figures[b].type = BISHOP;
-	cdev_data[d_num].figures[b].color = 'B';
-	cdev_data[d_num].figures[b].alive = 1;
-	cdev_data[d_num].figures[b].square.x = 2;
-	cdev_data[d_num].figures[b].square.y = 7;
-	cdev_data[d_num].board[square_b] = b;
+	cdev_data[d_num].pos.figures[b].type = BISHOP;
+	cdev_data[d_num].pos.figures[b].color = 'B';
+	cdev_data[d_num].pos.figures[b].square.x = 2;
+	cdev_data[d_num].pos.figures[b].square.y = 7;
+	cdev_data[d_num].pos.board[square_b] = b;
 
 	++w;
 	++b;
 
-	cdev_data[d_num].figures[w].type = BISHOP;
-	cdev_data[d_num].figures[w].color = 'W';
-	cdev_data[d_num].figures[w].alive = 1;
-	cdev_data[d_num].figures[w].square.x = 5;
-	cdev_data[d_num].figures[w].square.y = 0;
-	cdev_data[d_num].board[square_w + 3] = w;
+	cdev_data[d_num].pos.figures[w].type = BISHOP;
+	cdev_data[d_num].pos.figures[w].color = 'W';
+	cdev_data[d_num].pos.figures[w].square.x = 5;
+	cdev_data[d_num].pos.figures[w].square.y = 0;
+	cdev_data[d_num].pos.board[square_w + 3] = w;
 
-	cdev_data[d_num].figures[b].type = BISHOP;
-	cdev_data[d_num].figures[b].color = 'B';
-	cdev_data[d_num].figures[b].alive = 1;
-	cdev_data[d_num].figures[b].square.x = 5;
-	cdev_data[d_num].figures[b].square.y = 7;
-	cdev_data[d_num].board[square_b + 3] = b;
+	cdev_data[d_num].pos.figures[b].type = BISHOP;
+	cdev_data[d_num].pos.figures[b].color = 'B';
+	cdev_data[d_num].pos.figures[b].square.x = 5;
+	cdev_data[d_num].pos.figures[b].square.y = 7;
+	cdev_data[d_num].pos.board[square_b + 3] = b;
 
 	// Fill in the queens
 	++w;
@@ -334,19 +870,17 @@ static void set_board(int d_num) {
 	++square_w;
 	++square_b;
 
-	cdev_data[d_num].figures[w].type = QUEEN;
-	cdev_data[d_num].figures[w].color = 'W';
-	cdev_data[d_num].figures[w].alive = 1;
-	cdev_data[d_num].figures[w].square.x = 3;
-	cdev_data[d_num].figures[w].square.y = 0;
-	cdev_data[d_num].board[square_w] = w;
+	cdev_data[d_num].pos.figures[w].type = QUEEN;
+	cdev_data[d_num].pos.figures[w].color = 'W';
+	cdev_data[d_num].pos.figures[w].square.x = 3;
+	cdev_data[d_num].pos.figures[w].square.y = 0;
+	cdev_data[d_num].pos.board[square_w] = w;
 
-	cdev_data[d_num].figures[b].type = QUEEN;
-	cdev_data[d_num].figures[b].color = 'B';
-	cdev_data[d_num].figures[b].alive = 1;
-	cdev_data[d_num].figures[b].square.x = 3;
-	cdev_data[d_num].figures[b].square.y = 7;
-	cdev_data[d_num].board[square_b] = b;
+	cdev_data[d_num].pos.figures[b].type = QUEEN;
+	cdev_data[d_num].pos.figures[b].color = 'B';
+	cdev_data[d_num].pos.figures[b].square.x = 3;
+	cdev_data[d_num].pos.figures[b].square.y = 7;
+	cdev_data[d_num].pos.board[square_b] = b;
 
 	// Fill in the kings
 	++w;
@@ -354,821 +888,2454 @@ static void set_board(int d_num) {
 	++square_w;
 	++square_b;
 
-	cdev_data[d_num].figures[w].type = KING;
-	cdev_data[d_num].figures[w].color = 'W';
-	cdev_data[d_num].figures[w].alive = 1;
-	cdev_data[d_num].figures[w].square.x = 4;
-	cdev_data[d_num].figures[w].square.y = 0;
-	cdev_data[d_num].board[square_w] = w;
+	cdev_data[d_num].pos.figures[w].type = KING;
+	cdev_data[d_num].pos.figures[w].color = 'W';
+	cdev_data[d_num].pos.figures[w].square.x = 4;
+	cdev_data[d_num].pos.figures[w].square.y = 0;
+	cdev_data[d_num].pos.board[square_w] = w;
 
-	cdev_data[d_num].figures[b].type = KING;
-	cdev_data[d_num].figures[b].color = 'B';
-	cdev_data[d_num].figures[b].alive = 1;
-	cdev_data[d_num].figures[b].square.x = 4;
-	cdev_data[d_num].figures[b].square.y = 7;
-	cdev_data[d_num].board[square_b] = b;
+	cdev_data[d_num].pos.figures[b].type = KING;
+	cdev_data[d_num].pos.figures[b].color = 'B';
+	cdev_data[d_num].pos.figures[b].square.x = 4;
+	cdev_data[d_num].pos.figures[b].square.y = 7;
+	cdev_data[d_num].pos.board[square_b] = b;
 
 	// Fill in the empty squares
 	for (i = 16; i < 48; ++i) {
-		cdev_data[d_num].board[i] = -1;
+		cdev_data[d_num].pos.board[i] = -1;
 	}
+	init_position(&cdev_data[d_num].pos, 'W');
 
-	mutex_unlock(&d_mutex);
+	mutex_unlock(&cdev_data[d_num].lock);
 }
 
 /* Choose a CPU move */
-static int make_move(int d_num, char color, int testing) {
-	// Iterate through all pieces until a valid move is found
-	int i;
-	for (i = 0; i < 16; ++i) {
-		// Have to offset if the color is black
-		int j;
-		if (color == 'B') {
-			j = i + 16;
-		}
-		else {
-			j = i;
-		}
-
-		mutex_lock(&d_mutex);
-
-		// Iterate through player's pieces and choose a valid move
-		if (cdev_data[d_num].figures[j].alive) {
-			// Allocate a move array
-			coord_t* moves;
-			moves = kmalloc_array(32, sizeof(*moves), GFP_KERNEL);
-
-			int n_moves;
-			mutex_unlock(&d_mutex);
-			n_moves = find_move(d_num, moves, cdev_data[d_num].figures[j]);
-			mutex_lock(&d_mutex);
-
-			// Iterate through move array, check for check
-			int k;
-			for (k = 0; k < n_moves; ++k) {
-				// Save previous coordinate for the piece we are about to move
-				coord_t prev_c;
-				prev_c = cdev_data[d_num].figures[j].square;
-
-				// Check if there is an enemy piece in the destination square
-				int prev_sq = coord_to_sq(prev_c);
-
-				cdev_data[d_num].figures[j].square = moves[k];
-				int new_square;
-				new_square = coord_to_sq(moves[k]);
-
-				int prev_piece_idx = cdev_data[d_num].board[new_square];
-				piece_t prev_piece;
-				prev_piece.type = -1;
-				// If a square is not empty and has an enemy piece in it
-				if (prev_piece_idx != -1 && cdev_data[d_num].figures[prev_piece_idx].color != color) {
-					prev_piece.type = cdev_data[d_num].figures[prev_piece_idx].type;
-					cdev_data[d_num].figures[prev_piece_idx].alive = 0;
-				}
-
-				// Check if a pawn qualifies for a promotion
-				int promoted = 0;
-				if (cdev_data[d_num].figures[j].type == PAWN &&
-				((cdev_data[d_num].figures[j].color == 'B' && moves[k].y == 0) ||
-				(cdev_data[d_num].figures[j].color == 'W' && moves[k].y == 7))) {
-					// Promote to a queen
-					cdev_data[d_num].figures[j].type = QUEEN;
-					promoted = 1;
-				}
-
-				// Move piece to a new position
-				cdev_data[d_num].board[new_square] = j;
-				cdev_data[d_num].board[prev_sq] = -1;
+static int make_move(position_t *pos, char color, int testing) {
+	// Iterate through all legal moves until one is found
+	move_t moves[MAX_MOVES];
+	struct undo_t u;
+	int n_moves;
+	n_moves = gen_moves(pos, color, moves);
 
-				// Check for check
-				int check = 0;
-				mutex_unlock(&d_mutex);
-				check = in_check(d_num, color);
-				mutex_lock(&d_mutex);
-
-				// If valid
-				if (!check) {
-					if (moves) {
-						kfree(moves);
-					}
-					moves = NULL;
-
-					if (testing == 1) {
-						// Reset the current piece
-						cdev_data[d_num].figures[j].square = prev_c;
-						cdev_data[d_num].board[prev_sq] = j;
-						cdev_data[d_num].board[new_square] = prev_piece_idx;
-							// Reset the captured piece to alive, if applicable
-						if (prev_piece.type != -1) {
-							cdev_data[d_num].figures[prev_piece_idx].alive = 1;
-						}
-						// Reset piece type to PAWN if a pawn was promoted
-						if (promoted == 1) {
-							cdev_data[d_num].figures[j].type = PAWN;
-						}
-					}
-					// Found a valid move --> no check/checkmate
-					mutex_unlock(&d_mutex);
-					return 0;
-				}
-				// If not valid, reset to previous board state and keep going
-				else {
-					// Reset the current piece
-					cdev_data[d_num].figures[j].square = prev_c;
-					cdev_data[d_num].board[prev_sq] = j;
-					cdev_data[d_num].board[new_square] = prev_piece_idx;
-					// Reset the captured piece to alive, if applicable
-					if (prev_piece.type != -1) {
-						cdev_data[d_num].figures[prev_piece_idx].alive = 1;
-					}
-					// Reset piece type to PAWN if a pawn was promoted
-					if (promoted == 1) {
-						cdev_data[d_num].figures[j].type = PAWN;
-					}
-				}
-			}
-			// Deallocate array and move on to the next piece
-			if (moves) {
-				kfree(moves);
+	int k;
+	for (k = 0; k < n_moves; ++k) {
+		do_move(pos, moves[k], &u);
+		// Check for check
+		if (!in_check(pos, color)) {
+			// Found a valid move --> no check/checkmate
+			if (testing == 1) {
+				undo_move(pos, &u);
 			}
-			moves = NULL;
+			return 0;
 		}
-		mutex_unlock(&d_mutex);
+		// If not valid, reset to previous board state and keep going
+		undo_move(pos, &u);
 	}
 	// If we got here, there are no legal moves left --> checkmate
 	return 1;
 }
 
+/* First figure on list l of color c that attacks square sq, -1 if
+ * none. Sliders are blocked by the pieces in occ, figures in the
+ * removed mask are skipped. */
+static int find_attacker(position_t *pos, int c, int l, int sq, u64 occ, u32 removed) {
+	u64 from_set;	/* Squares this kind of piece could attack sq from */
+	int i;
+
+	// Attacks are symmetric, except that pawns attack sq from where
+	// a pawn of the other color standing on sq would attack
+	if (l == L_PAWN) {
+		from_set = pawn_attacks[!c][sq];
+	}
+	else if (l == L_KNIGHT) {
+		from_set = knight_attacks[sq];
+	}
+	else if (l == L_KING) {
+		from_set = king_attacks[sq];
+	}
+	else if (l == L_ROOK) {
+		from_set = rook_lines[sq];
+	}
+	else if (l == L_BISHOP) {
+		from_set = bishop_lines[sq];
+	}
+	else {
+		from_set = rook_lines[sq] | bishop_lines[sq];
+	}
+	// Only sliders have squares in between, for the others it is empty
+	for (i = 0; i < pos->count[c][l]; ++i) {
+		int idx = pos->pieces[c][l][i];
+		int from = SQ(pos->figures[idx].square);
+		if ((from_set & BIT_ULL(from)) && !(between[from][sq] & occ) &&
+		    !(removed & BIT(idx))) {
+			return idx;
+		}
+	}
+	return -1;
+}
+
 // Check whether the given color is in check
-static int in_check(int d_num, char color) {
-	mutex_lock(&d_mutex);
+static int in_check(position_t *pos, char color) {
+	u64 occ = pos->occ[0] | pos->occ[1];
+	int c = color == 'B';
+	int king = SQ(PIECE(pos, c, L_KING, 0)->square);
 
 	// Cycle through opponent's pieces
-	int i;
-	for (i = 0; i < 16; ++i) {
-		// Black king in check -> check white pieces
-		int j = i;
-		// White king in check -> check black pieces
-		if (color == 'W') {
-			j += 16;
-		}
-		if (cdev_data[d_num].figures[j].alive) {
-			coord_t *moves = kmalloc_array(32, sizeof(*moves), GFP_KERNEL);
-
-			mutex_unlock(&d_mutex);
-			int num_moves = find_move(d_num, moves, cdev_data[d_num].figures[j]);
-			mutex_lock(&d_mutex);
-
-			// Cycle through moves and check if any land on the king
-			int k;
-			for (k = 0; k < num_moves; ++k) {
-				coord_t king;
-				if (color == 'W') {
-					king = cdev_data[d_num].figures[KING].square;
-				}
-				else {
-					king = cdev_data[d_num].figures[KING + 16].square;
-				}
-
-				if (moves[k].x == king.x && moves[k].y == king.y) {
-					kfree(moves);
-					moves = NULL;
-					mutex_unlock(&d_mutex);
-					return 1;
-				}
-			}
-			if (moves) {
-				kfree(moves);
-			}
+	int l;
+	for (l = 0; l < N_LISTS; ++l) {
+		if (find_attacker(pos, !c, l, king, occ, 0) != -1) {
+			return 1;
 		}
 	}
-	// No opponent's piece can land on our king -> not in check
-	mutex_unlock(&d_mutex);
+	// No opponent's piece attacks our king -> not in check
 	return 0;
 }
 
-// Validate user's move
-static int move_valid(int d_num, piece_t piece, coord_t dest,
+// Validate user's move, play it on the board if it is legal.
+// Returns the move played, NO_MOVE if it is not legal
+static move_t move_valid(position_t *pos, piece_t piece, coord_t dest,
 		      int take_piece, int promote, piece_t opt_piece_capt, piece_t opt_piece_prom) {
-	mutex_lock(&d_mutex);
 
 	// Check that the piece is in that slot
-	coord_t prev_c = piece.square;
-	int prev_sq = coord_to_sq(prev_c);
-	int piece_idx = cdev_data[d_num].board[prev_sq];
+	int prev_sq = coord_to_sq(piece.square);
+	int piece_idx = pos->board[prev_sq];
 	if (piece_idx == -1) {
-		mutex_unlock(&d_mutex);
-		return 0;
+		return NO_MOVE;
 	}
-	piece_t p = cdev_data[d_num].figures[piece_idx];
-	if (p.color != piece.color || p.type != piece.type || !p.alive) {
-		mutex_unlock(&d_mutex);
-		return 0;
+	piece_t p = pos->figures[piece_idx];
+	if (p.color != piece.color || p.type != piece.type || !ALIVE(p)) {
+		return NO_MOVE;
 	}
 
-	// Generate all possible moves for the piece
-	coord_t *moves = kmalloc_array(32, sizeof(*moves), GFP_KERNEL);
+	// Generate all possible moves for the side
+	move_t moves[MAX_MOVES];
+	int num_moves = gen_moves(pos, piece.color, moves);
 
-	mutex_unlock(&d_mutex);
-	int num_moves = find_move(d_num, moves, piece);
-	mutex_lock(&d_mutex);
-
-	// Cycle through moves and check if any land on the destination square
+	// Cycle through moves and check if the piece can land on the destination square
+	int new_square = coord_to_sq(dest);
 	int k;
 	for (k = 0; k < num_moves; ++k) {
-		if (moves[k].x == dest.x && moves[k].y == dest.y) {
-			// Check if there is an enemy piece in the destination square
-			cdev_data[d_num].figures[piece_idx].square = moves[k];
-			int new_square;
-			new_square = coord_to_sq(moves[k]);
-
-			int prev_piece_idx = cdev_data[d_num].board[new_square];
-
-			piece_t prev_piece;
-			prev_piece.type = -1;
-			// If a square is not empty and has an enemy (computer) piece in it
-			if (prev_piece_idx != -1 && cdev_data[d_num].figures[prev_piece_idx].color ==
-								cdev_data[d_num].computer_color) {
-				prev_piece.type = cdev_data[d_num].figures[prev_piece_idx].type;
-				// Check if player specified correct options
-				if (!take_piece || opt_piece_capt.type != prev_piece.type) {
-					mutex_unlock(&d_mutex);
-					return 0;
-				}
-				cdev_data[d_num].figures[prev_piece_idx].alive = 0;
+		if (MOVE_FROM(moves[k]) == prev_sq && MOVE_TO(moves[k]) == new_square) {
+			int prev_piece_idx = pos->board[new_square];
+
+			// If the square has an enemy (computer) piece in it,
+			// check if player specified correct options
+			if (prev_piece_idx != -1 &&
+			    (!take_piece || opt_piece_capt.type != pos->figures[prev_piece_idx].type)) {
+				return NO_MOVE;
 			}
 
 			// Check if a pawn qualifies for a promotion
-			int promoted = 0;
-			if (cdev_data[d_num].figures[piece_idx].type == PAWN &&
-			((cdev_data[d_num].figures[piece_idx].color == 'B' && moves[k].y == 0) ||
-			(cdev_data[d_num].figures[piece_idx].color == 'W' && moves[k].y == 7))) {
+			int promo = 0;
+			if (piece.type == PAWN &&
+			((piece.color == 'B' && dest.y == 0) ||
+			(piece.color == 'W' && dest.y == 7))) {
 				if (!promote || opt_piece_prom.type == -1) {
-					mutex_unlock(&d_mutex);
-					return 0;
+					return NO_MOVE;
 				}
-				cdev_data[d_num].figures[piece_idx].type = opt_piece_prom.type;
-				promoted = 1;
+				promo = opt_piece_prom.type;
 			}
 
 			// Move piece to a new position
-			cdev_data[d_num].board[new_square] = piece_idx;
-			cdev_data[d_num].board[prev_sq] = -1;
-
-			// Check for check
-			int check = 0;
-			mutex_unlock(&d_mutex);
-			check = in_check(d_num, cdev_data[d_num].player_color);
-			mutex_lock(&d_mutex);
-
-			// If valid
-			if (!check) {
-				if (moves) {
-					kfree(moves);
-				}
-				moves = NULL;
-				// Found a valid move --> no check/checkmate
-				mutex_unlock(&d_mutex);
-				return 1;
-			}
-			// If not valid, reset to previous board state and keep going
-			else {
-				// Reset the current piece
-				cdev_data[d_num].figures[piece_idx].square = prev_c;
-				cdev_data[d_num].board[prev_sq] = piece_idx;
-				cdev_data[d_num].board[new_square] = prev_piece_idx;
-				// Reset the captured piece to alive, if applicable
-				if (prev_piece.type != -1) {
-					cdev_data[d_num].figures[prev_piece_idx].alive = 1;
-				}
-				// Reset piece type to PAWN if a pawn was promoted
-				if (promoted == 1) {
-					cdev_data[d_num].figures[piece_idx].type = PAWN;
-				}
+			struct undo_t u;
+			do_move(pos, MOVE(prev_sq, new_square, promo), &u);
+
+			// If our own king is left in check, reset to previous board state
+			if (in_check(pos, piece.color)) {
+				undo_move(pos, &u);
+				return NO_MOVE;
 			}
+			return u.move;
 		}
 	}
-	if (moves) {
-		kfree(moves);
-	}
 	// Cannot land there --> invalid move
-	mutex_unlock(&d_mutex);
-	return 0;
+	return NO_MOVE;
 }
 
-// Fills an array with all legal moves for a given piece
-static int find_move(int d_num, coord_t* moves, piece_t piece) {
-	int count = 0;
-	// Pawns
-	if (piece.type == PAWN) {
-		count = pawn_helper(d_num, moves, count, piece);
+/* Material values indexed by piece type */
+static const int piece_value[16] = {
+	[PAWN] = 100, [ROOK] = 500, [KNIGHT] = 320,
+	[BISHOP] = 330, [QUEEN] = 900, [KING] = 0
+};
+
+/* Piece list of each type, and the type of the pieces on each list */
+static const u8 list_of[16] = {
+	[PAWN] = L_PAWN, [ROOK] = L_ROOK, [KNIGHT] = L_KNIGHT,
+	[BISHOP] = L_BISHOP, [QUEEN] = L_QUEEN, [KING] = L_KING
+};
+static const u8 list_type[N_LISTS] = { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING };
+
+/* Letter of each piece type, as in commands and the board */
+static const char type_letter[16] = {
+	[PAWN] = 'P', [ROOK] = 'R', [KNIGHT] = 'N',
+	[BISHOP] = 'B', [QUEEN] = 'Q', [KING] = 'K'
+};
+
+/* Bonus for minor pieces close to the center, per rank or file */
+static const int center_bonus[8] = { 0, 4, 8, 12, 12, 8, 4, 0 };
+
+// Compute the Zobrist hash, occupancy and piece lists of a position from scratch
+static void init_position(position_t *pos, char turn) {
+	int i;
+	pos->key = 0;
+	pos->occ[0] = 0;
+	pos->occ[1] = 0;
+	memset(pos->count, 0, sizeof(pos->count));
+	for (i = 0; i < 32; ++i) {
+		piece_t *p = &pos->figures[i];
+		if (ALIVE(*p)) {
+			int c = p->color == 'B';
+			pos->key ^= zobrist[c][p->type][SQ(p->square)];
+			pos->occ[c] |= BIT_ULL(SQ(p->square));
+			plist_add(pos, c, list_of[p->type], i);
+		}
 	}
-	else if (piece.type == ROOK) {
-		count = rook_helper(d_num, moves, count, piece);
+	if (turn == 'B') {
+		pos->key ^= zobrist_side;
 	}
-	else if (piece.type == KNIGHT) {
-		count = knight_helper(d_num, moves, count, piece);
+}
+
+/* Set up a position from the first two fields of a FEN string, the
+ * pieces and the side to move, e.g. "8/P6k/8/8/8/8/8/K7 w". The game
+ * has no castling or en passant, so the other fields are ignored.
+ * Returns the side to move, or 0 if this is not a position we can play. */
+static char load_position(position_t *pos, const char *fen) {
+	/* Figures a piece of each type takes, as in set_board() */
+	static const u8 first[16] = {
+		[PAWN] = 0, [ROOK] = 8, [KNIGHT] = 10,
+		[BISHOP] = 12, [QUEEN] = 14, [KING] = 15
+	};
+	static const u8 last[16] = {
+		[PAWN] = 7, [ROOK] = 9, [KNIGHT] = 11,
+		[BISHOP] = 13, [QUEEN] = 14, [KING] = 15
+	};
+	u32 used = 0;	/* Bit i for figures[i] */
+	u8 kinds[2][N_LISTS] = { { 0 } };	/* Must fit on the piece lists */
+	int x = 0, y = 7;
+	int i;
+
+	for (i = 0; i < 64; ++i) {
+		pos->board[i] = -1;
 	}
-	else if (piece.type == BISHOP) {
-		count = bishop_helper(d_num, moves, count, piece);
+	for (i = 0; i < 32; ++i) {
+		pos->figures[i].type = PAWN | CAPTURED;
+		pos->figures[i].color = i < 16 ? 'W' : 'B';
+		pos->figures[i].square.x = 0;
+		pos->figures[i].square.y = 0;
 	}
-	else if (piece.type == QUEEN) {
-		count = queen_helper(d_num, moves, count, piece);
+
+	for (; *fen && *fen != ' '; ++fen) {
+		if (*fen == '/') {
+			if (x != 8 || y == 0) {
+				return 0;
+			}
+			x = 0;
+			--y;
+			continue;
+		}
+		if (*fen >= '1' && *fen <= '8') {
+			x += *fen - '0';
+			if (x > 8) {
+				return 0;
+			}
+			continue;
+		}
+
+		int type;
+		for (type = 0; type < 16; ++type) {
+			if (type_letter[type] && type_letter[type] == toupper(*fen)) {
+				break;
+			}
+		}
+		if (type == 16 || x > 7 || (type == PAWN && (y == 0 || y == 7))) {
+			return 0;
+		}
+		int base = islower(*fen) ? 16 : 0;
+		if (++kinds[base / 16][list_of[type]] > LIST_SIZE) {
+			return 0;
+		}
+		// The piece's own figure if it is free, else a promoted pawn's
+		for (i = base + first[type]; i <= base + last[type]; ++i) {
+			if (!(used & BIT(i))) {
+				break;
+			}
+		}
+		if (i > base + last[type]) {
+			if (type == KING) {
+				return 0;
+			}
+			for (i = base; i < base + 15; ++i) {
+				if (!(used & BIT(i))) {
+					break;
+				}
+			}
+			if (i == base + 15) {
+				return 0;
+			}
+		}
+		used |= BIT(i);
+		pos->figures[i].type = type;
+		pos->figures[i].square.x = x;
+		pos->figures[i].square.y = y;
+		pos->board[8 * y + x] = i;
+		++x;
 	}
-	else {
-		count = king_helper(d_num, moves, count, piece);
+	// All 8 ranks, both kings and a side to move
+	if (y != 0 || x != 8 || !(used & BIT(15)) || !(used & BIT(31)) ||
+	    *fen != ' ' || (fen[1] != 'w' && fen[1] != 'b')) {
+		return 0;
 	}
-
-	return count;
+	init_position(pos, fen[1] == 'w' ? 'W' : 'B');
+	return fen[1] == 'w' ? 'W' : 'B';
 }
 
-// Generate moves for a pawn
-static int pawn_helper(int d_num, coord_t* moves, int count, piece_t piece) {
-	mutex_lock(&d_mutex);
-
-	int y_move = 1;
-	if (piece.color == 'B') {
-		y_move = -1; // Black pieces reduce y value
-	}
-	// Check if it is the first move
-	if ((piece.color == 'W' && piece.square.y == 1) ||
-	    (piece.color == 'B' && piece.square.y == 6)) {
-		coord_t c;
-		c.x = piece.square.x;
-		c.y = piece.square.y + 2 * y_move;
-		// Check if the square is empty
-		int sq = coord_to_sq(c);
-		if (sq != -1 && cdev_data[d_num].board[sq] == -1) {
-			moves[count++] = c;
+/* Write the pieces and the side to move of a position the way
+ * load_position() reads them. Returns the length. */
+static int position_fen(position_t *pos, char turn, char *buf) {
+	int n = 0;
+	int x, y;
+	for (y = 7; y >= 0; --y) {
+		int empty = 0;
+		for (x = 0; x < 8; ++x) {
+			int idx = pos->board[8 * y + x];
+			if (idx == -1) {
+				++empty;
+				continue;
+			}
+			if (empty) {
+				buf[n++] = '0' + empty;
+				empty = 0;
+			}
+			buf[n] = type_letter[pos->figures[idx].type];
+			if (pos->figures[idx].color == 'B') {
+				buf[n] = tolower(buf[n]);
+			}
+			++n;
 		}
-	}
-	// Check if the pawn has reached the end of the board
-	if (piece.square.y != 0 || piece.square.x != 7)	{
-		coord_t c;
-		c.x = piece.square.x;
-		c.y = piece.square.y + y_move;
-		// Check if the square is empty
-		int sq = coord_to_sq(c);
-		if (sq != -1 && cdev_data[d_num].board[sq] == -1) {
-			moves[count++] = c;
-		}
-		// Check if there are pieces a pawn can take
-		coord_t c1, c2;
-		c1.x = c.x - 1;
-		c2.x = c.x + 1;
-		c1.y = c.y;
-		c2.y = c.y;
-
-		int sq1 = coord_to_sq(c1);
-		int sq2 = coord_to_sq(c2);
-		// Take a piece to the left
-		int piece_index = cdev_data[d_num].board[sq1];
-		if (sq1 != -1 && piece_index != -1 &&
-		    cdev_data[d_num].figures[piece_index].color != piece.color) {
-			moves[count++] = c1;
-		}
-		// Take a piece to the right
-		piece_index = cdev_data[d_num].board[sq2];
-		if (sq2 != -1 && piece_index != -1 &&
-		    cdev_data[d_num].figures[piece_index].color != piece.color) {
-			moves[count++] = c2;
-		}
-	}
-	mutex_unlock(&d_mutex);
-	return count;
-}
-
-// Checks if the proposed move coordinate does not have ally pieces in it
-static int verify_move_helper(int d_num, coord_t move, char color) {
-	mutex_lock(&d_mutex);
-	int sq = coord_to_sq(move);
-	if (sq != -1) {
-		// The move is valid if the square is empty or has an enemy piece in it
-		int i = cdev_data[d_num].board[sq];
-		if (i == -1 || cdev_data[d_num].figures[i].color != color) {
-			return 1;
+		if (empty) {
+			buf[n++] = '0' + empty;
 		}
+		buf[n++] = y ? '/' : ' ';
 	}
-	// Invalid move
-	mutex_unlock(&d_mutex);
-	return 0;
+	buf[n++] = turn == 'W' ? 'w' : 'b';
+	buf[n] = '\0';
+	return n;
 }
 
-static int knight_helper(int d_num, coord_t* moves, int count, piece_t piece) {
-	coord_t c;
-
-	// "Vertical" moves
-	c.x = piece.square.x - 1;
-	c.y = piece.square.y - 2;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+// Play a move on the board, saving what is needed to take it back
+static void do_move(position_t *pos, move_t m, struct undo_t *u) {
+	int from = MOVE_FROM(m);
+	int to = MOVE_TO(m);
+	int idx = pos->board[from];
+	piece_t *p = &pos->figures[idx];
+	int c = p->color == 'B';
+
+	u->move = m;
+	u->key = pos->key;
+	u->captured = pos->board[to];
+	u->promoted = 0;
+
+	// Take the enemy piece off the board
+	if (u->captured != -1) {
+		piece_t *capt = &pos->figures[u->captured];
+		pos->key ^= zobrist[!c][capt->type][to];
+		pos->occ[!c] ^= BIT_ULL(to);
+		plist_remove(pos, !c, list_of[capt->type], u->captured);
+		capt->type |= CAPTURED;
 	}
 
-	c.y = piece.square.y + 2;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+	pos->key ^= zobrist[c][p->type][from];
+	if (MOVE_PROMO(m)) {
+		p->type = MOVE_PROMO(m);
+		u->promoted = 1;
+		u->pawn_pos = pos->list_pos[idx];
+		plist_remove(pos, c, L_PAWN, idx);
+		plist_add(pos, c, list_of[p->type], idx);
 	}
+	pos->key ^= zobrist[c][p->type][to];
+	pos->key ^= zobrist_side;
 
-	c.x = piece.square.x + 1;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
-	}
+	pos->occ[c] ^= BIT_ULL(from) | BIT_ULL(to);
 
-	c.y = piece.square.y - 2;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
-	}
+	p->square.x = to & 7;
+	p->square.y = to >> 3;
+	pos->board[to] = idx;
+	pos->board[from] = -1;
+}
 
-	// "Horizontal" moves
-	c.x = piece.square.x + 2;
-	c.y = piece.square.y - 1;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+// Take back a move made by do_move
+static void undo_move(position_t *pos, struct undo_t *u) {
+	int from = MOVE_FROM(u->move);
+	int to = MOVE_TO(u->move);
+	int idx = pos->board[to];
+	int c = pos->figures[idx].color == 'B';
+
+	pos->figures[idx].square.x = from & 7;
+	pos->figures[idx].square.y = from >> 3;
+	if (u->promoted) {
+		// The promoted piece is the last one on its list
+		--pos->count[c][list_of[pos->figures[idx].type]];
+		pos->list_pos[idx] = u->pawn_pos;
+		plist_restore(pos, c, L_PAWN, idx);
+		pos->figures[idx].type = PAWN;
 	}
-
-	c.y = piece.square.y + 1;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+	pos->board[from] = idx;
+	pos->board[to] = u->captured;
+	pos->occ[c] ^= BIT_ULL(from) | BIT_ULL(to);
+	if (u->captured != -1) {
+		pos->figures[u->captured].type &= ~CAPTURED;
+		pos->occ[!c] ^= BIT_ULL(to);
+		plist_restore(pos, !c, list_of[pos->figures[u->captured].type], u->captured);
 	}
+	pos->key = u->key;
+}
 
-	c.x = piece.square.x - 2;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
-	}
+// Append figure idx to list l of color c
+static void plist_add(position_t *pos, int c, int l, int idx) {
+	pos->pieces[c][l][pos->count[c][l]] = idx;
+	pos->list_pos[idx] = pos->count[c][l]++;
+}
+
+// Take figure idx off its list, the last figure of the list fills the gap.
+// list_pos[idx] keeps the old place for plist_restore().
+static void plist_remove(position_t *pos, int c, int l, int idx) {
+	int last = pos->pieces[c][l][--pos->count[c][l]];
+	pos->pieces[c][l][pos->list_pos[idx]] = last;
+	pos->list_pos[last] = pos->list_pos[idx];
+}
 
-	c.y = piece.square.y - 1;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+// Undo plist_remove(), putting the list back in the order it was
+static void plist_restore(position_t *pos, int c, int l, int idx) {
+	int p = pos->list_pos[idx];
+	// Move the figure that filled the gap back to the end
+	if (p < pos->count[c][l]) {
+		int moved = pos->pieces[c][l][p];
+		pos->pieces[c][l][pos->count[c][l]] = moved;
+		pos->list_pos[moved] = pos->count[c][l];
 	}
-	return count;
+	pos->pieces[c][l][p] = idx;
+	++pos->count[c][l];
 }
 
-static int rook_helper(int d_num, coord_t* moves, int count, piece_t piece) {
-	mutex_lock(&d_mutex);
+// Fills an array with the pseudo-legal moves of one side, returns the count
+static int gen_moves(position_t *pos, char color, move_t *list) {
+	int c = color == 'B';
+	int n = 0;
+	n = gen_pawn_moves(pos, c, list, n);
+	n = gen_leaper_moves(pos, c, L_KNIGHT, knight_attacks, list, n);
+	n = gen_slider_moves(pos, c, L_BISHOP, 4, 8, list, n);
+	n = gen_slider_moves(pos, c, L_ROOK, 0, 4, list, n);
+	n = gen_slider_moves(pos, c, L_QUEEN, 0, 8, list, n);
+	n = gen_leaper_moves(pos, c, L_KING, king_attacks, list, n);
+	return n;
+}
 
-	coord_t c;
-	c.x = piece.square.x;
-	c.y = piece.square.y;
-	// Go right
-	int cont = 1;
-	while (cont) {
-		++c.x;
-		int sq = coord_to_sq(c);
-		// The square is off the board
-		if (sq == -1) {
-			cont = 0;
-		}
-		// The square is on the board
-		else {
-			int piece_index = cdev_data[d_num].board[sq];
-			if (piece_index == -1) {
-				// The square is empty, add the move
-				moves[count++] = c;
-			}
-			else if (cdev_data[d_num].figures[piece_index].color != piece.color) {
-				// The square has opponent's piece in it
-				// Store the move but don't continue
-				moves[count++] = c;
-				cont = 0;
-			}
-			else {
-				// The square has our piece in it
-				// Invalid move, stop
-				cont = 0;
+// Pawn moves of color c, appended to the list at n
+static int gen_pawn_moves(position_t *pos, int c, move_t *list, int n) {
+	int step = c ? -8 : 8; // Black pieces reduce y value
+	int i;
+	for (i = 0; i < pos->count[c][L_PAWN]; ++i) {
+		int from = SQ(PIECE(pos, c, L_PAWN, i)->square);
+		// Take enemy pieces diagonally
+		u64 targets = pawn_attacks[c][from] & pos->occ[!c];
+
+		// A pawn never stands on the last rank (it promotes there),
+		// so the square in front of it is always on the board
+		if (pos->board[from + step] == -1) {
+			targets |= BIT_ULL(from + step);
+			// On the first move it can also jump over that square
+			if (from >> 3 == (c ? 6 : 1) && pos->board[from + 2 * step] == -1) {
+				targets |= BIT_ULL(from + 2 * step);
 			}
 		}
-	}
-	// Go left
-	c.x = piece.square.x;
-	cont = 1;
-	while (cont) {
-		--c.x;
-		int sq = coord_to_sq(c);
-		// The square is off the board
-		if (sq == -1) {
-			cont = 0;
-		}
-		// The square is on the board
-		else {
-			int piece_index = cdev_data[d_num].board[sq];
-			if (piece_index == -1) {
-				// The square is empty, add the move
-				moves[count++] = c;
-			}
-			else if (cdev_data[d_num].figures[piece_index].color != piece.color) {
-				// The square has opponent's piece in it
-				// Store the move but don't continue
-				moves[count++] = c;
-				cont = 0;
+		for (; targets; targets &= targets - 1) {
+			int to = __ffs64(targets);
+			// A pawn reaching the last rank has to promote
+			if (to < 8 || to >= 56) {
+				list[n++] = MOVE(from, to, QUEEN);
+				list[n++] = MOVE(from, to, ROOK);
+				list[n++] = MOVE(from, to, BISHOP);
+				list[n++] = MOVE(from, to, KNIGHT);
 			}
 			else {
-				// The square has our piece in it
-				// Invalid move, stop
-				cont = 0;
+				list[n++] = MOVE(from, to, 0);
 			}
 		}
 	}
-	// Go up
-	c.x = piece.square.x;
-	cont = 1;
-	while (cont) {
-		++c.y;
-		int sq = coord_to_sq(c);
-		// The square is off the board
-		if (sq == -1) {
-			cont = 0;
-		}
-		// The square is on the board
-		else {
-			int piece_index = cdev_data[d_num].board[sq];
-			if (piece_index == -1) {
-				// The square is empty, add the move
-				moves[count++] = c;
-			}
-			else if (cdev_data[d_num].figures[piece_index].color != piece.color) {
-				// The square has opponent's piece in it
-				// Store the move but don't continue
-				moves[count++] = c;
-				cont = 0;
-			}
-			else {
-				// The square has our piece in it
-				// Invalid move, stop
-				cont = 0;
-			}
+	return n;
+}
+
+// Moves of the knights or the king of color c, using their attack table
+static int gen_leaper_moves(position_t *pos, int c, int l, const u64 *table,
+			    move_t *list, int n) {
+	int i;
+	for (i = 0; i < pos->count[c][l]; ++i) {
+		int from = SQ(PIECE(pos, c, l, i)->square);
+		u64 targets = table[from] & ~pos->occ[c];
+		for (; targets; targets &= targets - 1) {
+			list[n++] = MOVE(from, __ffs64(targets), 0);
 		}
 	}
-	// Go down
-	c.y = piece.square.y;
-	cont = 1;
-	while (cont) {
-		--c.y;
-		int sq = coord_to_sq(c);
-		// The square is off the board
-		if (sq == -1) {
-			cont = 0;
-		}
-		// The square is on the board
-		else {
-			int piece_index = cdev_data[d_num].board[sq];
-			if (piece_index == -1) {
-				// The square is empty, add the move
-				moves[count++] = c;
-			}
-			else if (cdev_data[d_num].figures[piece_index].color != piece.color) {
-				// The square has opponent's piece in it
-				// Store the move but don't continue
-				moves[count++] = c;
-				cont = 0;
-			}
-			else {
-				// The square has our piece in it
-				// Invalid move, stop
-				cont = 0;
+	return n;
+}
+
+// Moves of the rooks, bishops or queens of color c along rays first to last - 1
+static int gen_slider_moves(position_t *pos, int c, int l, int first, int last,
+			    move_t *list, int n) {
+	u64 occ = pos->occ[0] | pos->occ[1];
+	int i, d, k;
+	for (i = 0; i < pos->count[c][l]; ++i) {
+		int from = SQ(PIECE(pos, c, l, i)->square);
+		for (d = first; d < last; ++d) {
+			for (k = 0; k < ray_len[from][d]; ++k) {
+				int to = rays[from][d][k];
+				// Blocked: the piece may only take an enemy
+				if (occ & BIT_ULL(to)) {
+					if (pos->occ[!c] & BIT_ULL(to)) {
+						list[n++] = MOVE(from, to, 0);
+					}
+					break;
+				}
+				list[n++] = MOVE(from, to, 0);
 			}
 		}
 	}
-	mutex_unlock(&d_mutex);
-	return count;
+	return n;
 }
 
-static int bishop_helper(int d_num, coord_t* moves, int count, piece_t piece) {
-	mutex_lock(&d_mutex);
-
-	coord_t c = piece.square;
-	int cont = 1;
-
-	// inc x, inc y
-	while (cont) {
-		++c.x;
-		++c.y;
-		int sq = coord_to_sq(c);
-		// The square is off the board
-		if (sq == -1) {
-			cont = 0;
-		}
-		// The square is on the board
-		else {
-			int piece_index = cdev_data[d_num].board[sq];
-			if (piece_index == -1) {
-				// The square is empty, add the move
-				moves[count++] = c;
-			}
-			else if (cdev_data[d_num].figures[piece_index].color != piece.color) {
-				// The square has opponent's piece in it
-				// Store the move but don't continue
-				moves[count++] = c;
-				cont = 0;
-			}
-			else {
-				// The square has our piece in it
-				// Invalid move, stop
-				cont = 0;
-			}
+// Check that a move (e.g. one taken from the hash table) is legal
+static int move_legal(position_t *pos, char color, move_t m) {
+	move_t moves[MAX_MOVES];
+	struct undo_t u;
+	int n = gen_moves(pos, color, moves);
+	int k;
+	for (k = 0; k < n; ++k) {
+		if (moves[k] == m) {
+			do_move(pos, m, &u);
+			n = !in_check(pos, color);
+			undo_move(pos, &u);
+			return n;
 		}
 	}
+	return 0;
+}
 
-	cont = 1;
-	c = piece.square;
-	// inc x, dec y
-	while (cont) {
-		++c.x;
-		--c.y;
-		int sq = coord_to_sq(c);
-		// The square is off the board
-		if (sq == -1) {
-			cont = 0;
-		}
-		// The square is on the board
-		else {
-			int piece_index = cdev_data[d_num].board[sq];
-			if (piece_index == -1) {
-				// The square is empty, add the move
-				moves[count++] = c;
-			}
-			else if (cdev_data[d_num].figures[piece_index].color != piece.color) {
-				// The square has opponent's piece in it
-				// Store the move but don't continue
-				moves[count++] = c;
-				cont = 0;
-			}
-			else {
-				// The square has our piece in it
-				// Invalid move, stop
-				cont = 0;
-			}
+// Fills an array with the legal moves of one side, returns the count
+static int legal_moves(position_t *pos, char color, move_t *list) {
+	struct undo_t u;
+	int n = gen_moves(pos, color, list);
+	int legal = 0;
+	int k;
+	for (k = 0; k < n; ++k) {
+		do_move(pos, list[k], &u);
+		if (!in_check(pos, color)) {
+			list[legal++] = list[k];
 		}
+		undo_move(pos, &u);
 	}
+	return legal;
+}
 
-	cont = 1;
-	c = piece.square;
-	// dec x, inc y
-	while (cont) {
-		--c.x;
-		++c.y;
-		int sq = coord_to_sq(c);
-		// The square is off the board
-		if (sq == -1) {
-			cont = 0;
+// Static evaluation from the point of view of the given color
+static int evaluate(position_t *pos, char color) {
+	int score[2] = { 0, 0 };
+	int c, l, i;
+	for (c = 0; c < 2; ++c) {
+		for (l = 0; l < N_LISTS; ++l) {
+			score[c] += pos->count[c][l] * piece_value[list_type[l]];
 		}
-		// The square is on the board
-		else {
-			int piece_index = cdev_data[d_num].board[sq];
-			if (piece_index == -1) {
-				// The square is empty, add the move
-				moves[count++] = c;
-			}
-			else if (cdev_data[d_num].figures[piece_index].color != piece.color) {
-				// The square has opponent's piece in it
-				// Store the move but don't continue
-				moves[count++] = c;
-				cont = 0;
-			}
-			else {
-				// The square has our piece in it
-				// Invalid move, stop
-				cont = 0;
+		// Reward pawns for advancing
+		for (i = 0; i < pos->count[c][L_PAWN]; ++i) {
+			int y = PIECE(pos, c, L_PAWN, i)->square.y;
+			score[c] += 8 * (c ? 6 - y : y - 1);
+		}
+		// And minor pieces for staying close to the center
+		for (l = L_KNIGHT; l <= L_BISHOP; ++l) {
+			for (i = 0; i < pos->count[c][l]; ++i) {
+				piece_t *p = PIECE(pos, c, l, i);
+				score[c] += center_bonus[p->square.x] + center_bonus[p->square.y];
 			}
 		}
 	}
+	c = color == 'B';
+	return score[c] - score[!c];
+}
 
-	cont = 1;
-	c = piece.square;
-	// dec x, dec y
-	while (cont) {
-		--c.x;
-		--c.y;
-		int sq = coord_to_sq(c);
-		// The square is off the board
-		if (sq == -1) {
-			cont = 0;
+// Sort moves so that the hash move and the best captures are tried first
+static void order_moves(position_t *pos, move_t *moves, int *scores, int n,
+			move_t hash_move) {
+	int k;
+	for (k = 0; k < n; ++k) {
+		int victim = pos->board[MOVE_TO(moves[k])];
+		int attacker = pos->board[MOVE_FROM(moves[k])];
+		scores[k] = 0;
+		if (moves[k] == hash_move) {
+			scores[k] = 1 << 20;
 		}
-		// The square is on the board
-		else {
-			int piece_index = cdev_data[d_num].board[sq];
-			if (piece_index == -1) {
-				// The square is empty, add the move
-				moves[count++] = c;
-			}
-			else if (cdev_data[d_num].figures[piece_index].color != piece.color) {
-				// The square has opponent's piece in it
-				// Store the move but don't continue
-				moves[count++] = c;
-				cont = 0;
-			}
-			else {
-				// The square has our piece in it
-				// Invalid move, stop
-				cont = 0;
-			}
+		else if (victim != -1) {
+			// Most valuable victim, least valuable attacker
+			scores[k] = 16 * piece_value[pos->figures[victim].type] -
+				piece_value[pos->figures[attacker].type] / 10 + 1;
 		}
+		scores[k] += piece_value[MOVE_PROMO(moves[k])];
+	}
+	// Insertion sort, move lists are short
+	for (k = 1; k < n; ++k) {
+		move_t m = moves[k];
+		int sc = scores[k];
+		int j = k - 1;
+		while (j >= 0 && scores[j] < sc) {
+			moves[j + 1] = moves[j];
+			scores[j + 1] = scores[j];
+			--j;
+		}
+		moves[j + 1] = m;
+		scores[j + 1] = sc;
 	}
-	mutex_unlock(&d_mutex);
-	return count;
 }
 
-static int queen_helper(int d_num, coord_t* moves, int count, piece_t piece) {
-	count = rook_helper(d_num, moves, count, piece);
-	count = bishop_helper(d_num, moves, count, piece);
-	return count;
+/* Mate scores are stored relative to the node so that they stay
+ * correct when the position is reached at another ply */
+static int tt_score_to(int score, int ply) {
+	if (score > MATE - MAX_PLY) {
+		return score + ply;
+	}
+	if (score < -MATE + MAX_PLY) {
+		return score - ply;
+	}
+	return score;
 }
 
-static int king_helper(int d_num, coord_t* moves, int count, piece_t piece) {
-	coord_t c = piece.square;
-	// Inc/dec x
-	++c.x;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+static int tt_score_from(int score, int ply) {
+	if (score > MATE - MAX_PLY) {
+		return score - ply;
 	}
-	c = piece.square;
-
-	--c.x;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+	if (score < -MATE + MAX_PLY) {
+		return score + ply;
 	}
-	c = piece.square;
+	return score;
+}
 
-	// inc/dec y
-	++c.y;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+/* Static exchange evaluation: the material the side making a capture
+ * (or a promotion) wins if both sides keep recapturing on the target
+ * square with their least valuable attacker, and may stop when that
+ * is better for them. Negative means the capture loses material. */
+static int see(position_t *pos, move_t m) {
+	int to = MOVE_TO(m);
+	int attacker = pos->board[MOVE_FROM(m)];
+	int victim = pos->board[to];
+	u32 removed = BIT(attacker);
+	/* Pieces that took part are lifted off, letting sliders behind them through */
+	u64 occ = (pos->occ[0] | pos->occ[1]) & ~BIT_ULL(MOVE_FROM(m));
+	int side = pos->figures[attacker].color == 'W';	/* 1 for black */
+	int on_square;	/* Value of the piece standing on the target square */
+	int gain[32];
+	int d = 0;
+	int l;
+
+	gain[0] = victim != -1 ? piece_value[pos->figures[victim].type] : 0;
+	on_square = piece_value[pos->figures[attacker].type];
+	if (MOVE_PROMO(m)) {
+		gain[0] += piece_value[MOVE_PROMO(m)] - piece_value[PAWN];
+		on_square = piece_value[MOVE_PROMO(m)];
 	}
-	c = piece.square;
-
-	--c.y;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+	if (victim != -1) {
+		removed |= BIT(victim);
 	}
-	c = piece.square;
 
-	// inc both
-	++c.x;
-	++c.y;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+	for (;;) {
+		// Find the least valuable piece of the side to move attacking
+		// the square: the lists go from the least valuable kind up
+		int best = -1;
+		for (l = 0; l < N_LISTS && best == -1; ++l) {
+			best = find_attacker(pos, side, l, to, occ, removed);
+		}
+		if (best == -1) {
+			break;
+		}
+		++d;
+		gain[d] = on_square - gain[d - 1];
+		// The king is worth everything: it can only take last
+		on_square = pos->figures[best].type == KING ? MATE : piece_value[pos->figures[best].type];
+		removed |= BIT(best);
+		occ &= ~BIT_ULL(SQ(pos->figures[best].square));
+		side = !side;
 	}
-	c = piece.square;
-
-	// dec both
-	--c.x;
-	--c.y;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+	// Let each side stop capturing when that is better for it
+	for (; d > 0; --d) {
+		gain[d - 1] = -max(-gain[d - 1], gain[d]);
 	}
-	c = piece.square;
+	return gain[0];
+}
 
-	// inc x dec y
-	++c.x;
-	--c.y;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
+/* Count a node. Now and then give the CPU away and give up if the
+ * node budget is used up. Returns 1 if the search has to stop. A
+ * killed caller sets stop itself, see pool_search(). */
+static int count_node(struct search_t *s) {
+	if ((++s->nodes & 1023) == 0) {
+		cond_resched();
+		if (s->nodes >= s->max_nodes) {
+			WRITE_ONCE(s->stop, 1);
+		}
 	}
-	c = piece.square;
+	return READ_ONCE(s->stop);
+}
 
-	// dec x inc y
-	--c.x;
-	++c.y;
-	if (verify_move_helper(d_num, c, piece.color)) {
-		moves[count++] = c;
-	}
+// Does color c have anything besides pawns and the king?
+static int has_pieces(position_t *pos, int c) {
+	return pos->count[c][L_KNIGHT] || pos->count[c][L_BISHOP] ||
+	       pos->count[c][L_ROOK] || pos->count[c][L_QUEEN];
+}
 
-	return count;
+/* Start the search of a node at ply: fill in its frame, to be run
+ * from state FRAME_ENTER unless the caller picks another */
+static struct search_frame *push_frame(struct search_t *s, int ply, char color, int depth,
+				       int alpha, int beta, int null_ok) {
+	struct search_frame *f = &s->frames[ply];
+
+	f->state = FRAME_ENTER;
+	f->color = color;
+	f->depth = depth;
+	f->alpha = alpha;
+	f->beta = beta;
+	f->null_ok = null_ok;
+	return f;
 }
 
-// Function definitions
-static ssize_t d_read(struct file *filp,
-		char __user *buf, size_t len, loff_t *offset) {
+/* Negamax alpha-beta search, returns the score for the side to move.
+ * null_ok is 0 right after a null move, so that two are never made in a row.
+ *
+ * At the leaves a quiescence search keeps playing captures and
+ * promotions until the position is quiet, so that the evaluation is
+ * not taken in the middle of an exchange. Captures that lose material
+ * by static exchange evaluation are not searched.
+ *
+ * The search does not recurse: what each node keeps while its children
+ * are searched is in s->frames[ply], and a child's score comes back in
+ * ret to the state its parent left in its frame. However deep the
+ * search goes it only takes this function's stack, the depth is only
+ * limited by MAX_PLY. */
+static int alphabeta(struct search_t *s, char color, int depth, int ply,
+		     int alpha, int beta, int null_ok) {
+	const int root = ply;
+	position_t *pos = &s->pos;
+	int ret = 0;	/* Score of the node that just finished */
+
+	push_frame(s, ply, color, depth, alpha, beta, null_ok);
+	for (;;) {
+		struct search_frame *f = &s->frames[ply];
+		char enemy = f->color == 'W' ? 'B' : 'W';
+		move_t *moves = s->moves[ply];
+		struct tt_entry *e;
+		int score, all, k;
+
+		switch (f->state) {
+		case FRAME_ENTER:
+			if (count_node(s)) {
+				ret = 0;
+				goto pop;
+			}
+			// Resolve captures before evaluating
+			if (f->depth <= 0) {
+				f->state = FRAME_QUIESCE;
+				continue;
+			}
+			if (ply >= MAX_PLY - 1) {
+				ret = evaluate(pos, f->color);
+				goto pop;
+			}
 
-	mutex_lock(&d_mutex);
+			// Look the position up in the transposition table
+			f->hash_move = NO_MOVE;
+			e = &s->tt[pos->key & s->tt_mask];
+			if (e->key == pos->key) {
+				f->hash_move = e->move;
+				if (ply > 0 && e->depth >= f->depth) {
+					score = tt_score_from(e->score, ply);
+					if (e->flag == TT_EXACT ||
+					    (e->flag == TT_LOWER && score >= f->beta) ||
+					    (e->flag == TT_UPPER && score <= f->alpha)) {
+						ret = score;
+						goto pop;
+					}
+				}
+			}
 
-	int d_num;
-	d_num = MINOR(filp->f_path.dentry->d_inode->i_rdev);
-	printk("Reading device: %d\n", d_num);
+			f->check = in_check(pos, f->color);
+			f->old_alpha = f->alpha;
+			f->best = -INF;
+			f->best_move = NO_MOVE;
+			f->legal = 0;
+
+			/* Null move: let the opponent move twice. If a shallow search still
+			 * fails high, a real move would too. Not in check, and not with
+			 * only pawns left, where every move may be worse than passing (zugzwang) */
+			if ((s->features & SEARCH_NULL) && f->null_ok && !f->check && f->depth >= 3 &&
+			    f->beta < MATE - MAX_PLY && has_pieces(pos, f->color == 'B') &&
+			    evaluate(pos, f->color) >= f->beta) {
+				int r = f->depth > 6 ? 3 : 2;
+				pos->key ^= zobrist_side;
+				f->state = FRAME_NULL_DONE;
+				push_frame(s, ply + 1, enemy, f->depth - 1 - r, -f->beta, -f->beta + 1, 0);
+				++ply;
+				continue;
+			}
+			f->state = FRAME_MOVES;
+			continue;
+
+		case FRAME_NULL_DONE:
+			pos->key ^= zobrist_side;
+			score = -ret;
+			if (READ_ONCE(s->stop)) {
+				ret = 0;
+				goto pop;
+			}
+			if (score >= f->beta) {
+				// A mate found after passing is not a real one
+				ret = score > MATE - MAX_PLY ? f->beta : score;
+				goto pop;
+			}
+			f->state = FRAME_MOVES;
+			/* fall through */
+		case FRAME_MOVES:
+			f->n = gen_moves(pos, f->color, moves);
+			order_moves(pos, moves, s->scores[ply], f->n, f->hash_move);
+			f->k = 0;
+			f->state = FRAME_NEXT;
+			/* fall through */
+		case FRAME_NEXT:
+			// Skip moves that leave our king in check
+			for (; f->k < f->n; ++f->k) {
+				f->reduce = pos->board[MOVE_TO(moves[f->k])] == -1 &&
+					    !MOVE_PROMO(moves[f->k]);	/* Quiet? */
+				do_move(pos, moves[f->k], &s->undo[ply]);
+				if (!in_check(pos, f->color)) {
+					break;
+				}
+				undo_move(pos, &s->undo[ply]);
+			}
+			if (f->k == f->n) {
+				f->state = FRAME_END;
+				continue;
+			}
+			++f->legal;
 
-	int msg_len;
-	msg_len = strlen(cdev_data[d_num].reply);
-	if (len > msg_len) {
-		len = msg_len;
+			// Late move reductions: quiet moves sorted far down the list
+			// rarely turn out best, try them at a lower depth first
+			if ((s->features & SEARCH_LMR) && f->legal > 3 && f->depth >= 3 &&
+			    f->reduce && !f->check && !in_check(pos, enemy)) {
+				f->reduce = f->legal > 8 && f->depth >= 6 ? 2 : 1;
+			}
+			else {
+				f->reduce = 0;
+			}
+
+			if (f->legal == 1) {
+				f->state = FRAME_MOVE_DONE;
+				push_frame(s, ply + 1, enemy, f->depth - 1, -f->beta, -f->alpha, 1);
+			}
+			else {
+				// PVS: only show that the move is no better than alpha
+				f->b = (s->features & SEARCH_PVS) ? f->alpha + 1 : f->beta;
+				f->state = FRAME_REDUCED_DONE;
+				push_frame(s, ply + 1, enemy, f->depth - 1 - f->reduce, -f->b, -f->alpha, 1);
+			}
+			++ply;
+			continue;
+
+		case FRAME_REDUCED_DONE:
+			// The reduced move looks good after all, search it fully
+			if (f->reduce && -ret > f->alpha) {
+				f->state = FRAME_FULL_DONE;
+				push_frame(s, ply + 1, enemy, f->depth - 1, -f->b, -f->alpha, 1);
+				++ply;
+				continue;
+			}
+			/* fall through */
+		case FRAME_FULL_DONE:
+			// Better than alpha: get its real score
+			if (f->b != f->beta && -ret > f->alpha && -ret < f->beta) {
+				f->state = FRAME_MOVE_DONE;
+				push_frame(s, ply + 1, enemy, f->depth - 1, -f->beta, -f->alpha, 1);
+				++ply;
+				continue;
+			}
+			/* fall through */
+		case FRAME_MOVE_DONE:
+			score = -ret;
+			undo_move(pos, &s->undo[ply]);
+			if (READ_ONCE(s->stop)) {
+				ret = 0;
+				goto pop;
+			}
+			f->state = FRAME_NEXT;
+			if (score > f->best) {
+				f->best = score;
+				f->best_move = moves[f->k];
+				if (score > f->alpha) {
+					f->alpha = score;
+					if (ply == 0) {
+						s->root_best = f->best_move;
+					}
+					if (f->alpha >= f->beta) {
+						f->state = FRAME_END;
+					}
+				}
+			}
+			++f->k;
+			continue;
+
+		case FRAME_END:
+			// No legal moves: checkmate or stalemate
+			if (!f->legal) {
+				ret = f->check ? -MATE + ply : 0;
+				goto pop;
+			}
+			e = &s->tt[pos->key & s->tt_mask];
+			e->key = pos->key;
+			e->move = f->best_move;
+			e->depth = f->depth;
+			e->score = tt_score_to(f->best, ply);
+			if (f->best >= f->beta) {
+				e->flag = TT_LOWER;
+			}
+			else if (f->best > f->old_alpha) {
+				e->flag = TT_EXACT;
+			}
+			else {
+				e->flag = TT_UPPER;
+			}
+			ret = f->best;
+			goto pop;
+
+		case FRAME_QUIESCE:
+			if (count_node(s)) {
+				ret = 0;
+				goto pop;
+			}
+			// Standing pat: the side to move does not have to capture
+			f->best = evaluate(pos, f->color);
+			if (f->best >= f->beta || ply >= MAX_PLY - 1) {
+				ret = f->best;
+				goto pop;
+			}
+			if (f->best > f->alpha) {
+				f->alpha = f->best;
+			}
+
+			// Keep only the captures and promotions that do not lose material
+			all = gen_moves(pos, f->color, moves);
+			f->n = 0;
+			for (k = 0; k < all; ++k) {
+				if ((pos->board[MOVE_TO(moves[k])] != -1 || MOVE_PROMO(moves[k])) &&
+				    see(pos, moves[k]) >= 0) {
+					moves[f->n++] = moves[k];
+				}
+			}
+			order_moves(pos, moves, s->scores[ply], f->n, NO_MOVE);
+			f->k = 0;
+			f->state = FRAME_QUIESCE_NEXT;
+			/* fall through */
+		case FRAME_QUIESCE_NEXT:
+			for (; f->k < f->n; ++f->k) {
+				do_move(pos, moves[f->k], &s->undo[ply]);
+				if (!in_check(pos, f->color)) {
+					break;
+				}
+				undo_move(pos, &s->undo[ply]);
+			}
+			if (f->k == f->n) {
+				ret = f->best;
+				goto pop;
+			}
+			f->state = FRAME_QUIESCE_DONE;
+			push_frame(s, ply + 1, enemy, 0, -f->beta, -f->alpha, 0)->state = FRAME_QUIESCE;
+			++ply;
+			continue;
+
+		case FRAME_QUIESCE_DONE:
+			score = -ret;
+			undo_move(pos, &s->undo[ply]);
+			if (READ_ONCE(s->stop)) {
+				ret = 0;
+				goto pop;
+			}
+			if (score > f->best) {
+				f->best = score;
+				if (score > f->alpha) {
+					f->alpha = score;
+					if (f->alpha >= f->beta) {
+						ret = f->best;
+						goto pop;
+					}
+				}
+			}
+			++f->k;
+			f->state = FRAME_QUIESCE_NEXT;
+			continue;
+		}
+		continue;
+
+pop:
+		// Hand the score to the parent, which goes on from its state
+		if (ply == root) {
+			return ret;
+		}
+		--ply;
+	}
+}
+
+/* One iteration of iterative deepening. A finished iteration leaves
+ * its best move in s->best and fills the hash table for the next one.
+ * Returns 1 if there is no point in going deeper. */
+static int search_iteration(struct search_t *s, int depth) {
+	int alpha = -INF;
+	int beta = INF;
+	int score;
+
+	if (s->multipv) {
+		return multipv_iteration(s, depth);
+	}
+	// Aspiration window: expect a score close to the last iteration's
+	if ((s->features & SEARCH_ASPIRATION) && depth > 1 &&
+	    abs(s->score) < MATE - MAX_PLY) {
+		alpha = s->score - ASPIRATION;
+		beta = s->score + ASPIRATION;
+	}
+	for (;;) {
+		s->root_best = NO_MOVE;
+		score = alphabeta(s, s->color, depth, 0, alpha, beta, 1);
+		if (READ_ONCE(s->stop)) {
+			return 1;
+		}
+		// Outside the window: open it on that side and search again
+		if (score <= alpha && alpha > -INF) {
+			alpha = -INF;
+		}
+		else if (score >= beta && beta < INF) {
+			beta = INF;
+		}
+		else {
+			break;
+		}
+	}
+	s->best = s->root_best;
+	s->score = score;
+	s->depth = depth;
+	// No point in searching deeper once a mate is found
+	return score > MATE - MAX_PLY || score < -MATE + MAX_PLY;
+}
+
+/* An iteration of "06" that finds the s->multipv best root moves.
+ * A root move only needs an exact score if it beats the worst of the
+ * best moves found so far; the others are refuted against that score,
+ * and all lines share the hash table and the previous iterations, so
+ * this costs little more than a normal search. */
+static int multipv_iteration(struct search_t *s, int depth) {
+	position_t *pos = &s->pos;
+	char enemy = s->color == 'W' ? 'B' : 'W';
+	move_t *moves = s->moves[0];
+	move_t top[MAX_PV];
+	int top_score[MAX_PV];
+	int n_top = 0;
+	int n, k, i, j;
+
+	n = gen_moves(pos, s->color, moves);
+	order_moves(pos, moves, s->scores[0], n, NO_MOVE);
+	// Try the best moves of the last iteration first, in their order
+	for (i = s->pv_count - 1; i >= 0; --i) {
+		for (k = 0; k < n; ++k) {
+			if (moves[k] == s->pv_moves[i]) {
+				break;
+			}
+		}
+		if (k < n) {
+			memmove(moves + 1, moves, k * sizeof(*moves));
+			moves[0] = s->pv_moves[i];
+		}
+	}
+
+	for (k = 0; k < n; ++k) {
+		do_move(pos, moves[k], &s->undo[0]);
+		if (in_check(pos, s->color)) {
+			undo_move(pos, &s->undo[0]);
+			continue;
+		}
+		int alpha = n_top < s->multipv ? -INF : top_score[n_top - 1];
+		int score = -alphabeta(s, enemy, depth - 1, 1, -INF, -alpha, 1);
+		undo_move(pos, &s->undo[0]);
+		if (READ_ONCE(s->stop)) {
+			break;
+		}
+		if (score <= alpha) {
+			continue;
+		}
+		// Insert it, keeping the best first, the worst drops off a full list
+		if (n_top < s->multipv) {
+			++n_top;
+		}
+		for (j = n_top - 1; j > 0 && top_score[j - 1] < score; --j) {
+			top[j] = top[j - 1];
+			top_score[j] = top_score[j - 1];
+		}
+		top[j] = moves[k];
+		top_score[j] = score;
+	}
+
+	// Out of time: keep the last finished iteration if there is one
+	if (READ_ONCE(s->stop) && s->depth > 0) {
+		return 1;
+	}
+	memcpy(s->pv_moves, top, n_top * sizeof(*top));
+	memcpy(s->pv_scores, top_score, n_top * sizeof(*top_score));
+	s->pv_count = n_top;
+	if (READ_ONCE(s->stop)) {
+		return 1;
+	}
+	s->best = n_top ? top[0] : NO_MOVE;
+	s->score = n_top ? top_score[0] : 0;
+	s->depth = depth;
+	// No legal moves, nothing to look at
+	return n_top == 0;
+}
+
+// Iterative deepening without interruptions, for the search threads
+static void iterate(struct search_t *s) {
+	int d;
+	s->nodes = 0;
+	s->best = NO_MOVE;
+	s->depth = 0;
+	for (d = 1; d <= s->max_depth; ++d) {
+		if (search_iteration(s, d)) {
+			break;
+		}
+	}
+}
+
+/* Allocate the search state and the hash table of a game, on its node
+ * and charged to its memory cgroup. The shrinker may have freed them
+ * while the game was idle, then they are allocated again. */
+static int engine_alloc(int d_num) {
+	struct d_data *game = &cdev_data[d_num];
+	struct mem_cgroup *old = set_active_memcg(game->memcg);
+	int ret = 0;
+
+	if (!game->tt) {
+		unsigned long n = rounddown_pow_of_two(max(hash_kb, 1) * 1024UL /
+						       sizeof(struct tt_entry));
+		game->tt = kvzalloc_node(n * sizeof(struct tt_entry), GFP_KERNEL_ACCOUNT, game->node);
+		if (!game->tt) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		game->tt_mask = n - 1;
+	}
+	if (!game->search) {
+		game->search = kvzalloc_node(sizeof(struct search_t), GFP_KERNEL_ACCOUNT, game->node);
+		if (!game->search) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		hrtimer_init(&game->search->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		game->search->timer.function = deadline_fn;
+	}
+	game->search->tt = game->tt;
+	game->search->tt_mask = game->tt_mask;
+out:
+	set_active_memcg(old);
+	return ret;
+}
+
+/* Free the search state and the hash table of a game, unless a search
+ * may be using them. Returns the pages freed. Called with the game lock held. */
+static unsigned long engine_free(int d_num) {
+	struct d_data *game = &cdev_data[d_num];
+	unsigned long pages = 0;
+
+	if (game->searching || game->pondering) {
+		return 0;
+	}
+	if (game->tt) {
+		pages += DIV_ROUND_UP((game->tt_mask + 1) * sizeof(struct tt_entry), PAGE_SIZE);
+	}
+	if (game->search) {
+		pages += DIV_ROUND_UP(sizeof(struct search_t), PAGE_SIZE);
+	}
+	kvfree(game->search);
+	kvfree(game->tt);
+	game->search = NULL;
+	game->tt = NULL;
+	return pages;
+}
+
+// The move time is up, make the search return
+static enum hrtimer_restart deadline_fn(struct hrtimer *timer) {
+	struct search_t *s = container_of(timer, struct search_t, timer);
+	WRITE_ONCE(s->stop, 1);
+	return HRTIMER_NORESTART;
+}
+
+/* Fair share of the CPU. A game and the games of one user (the euid
+ * that sent the game its last command) may search game_budget and
+ * uid_budget nodes per budget_window ms. A search gets what is left,
+ * but at least BUDGET_MIN_NODES, so a game over its budget still moves,
+ * only weaker. At most max_searches searches run at once, the others
+ * wait for a slot, which goes to the waiter whose user has searched
+ * the least in this window. */
+struct uid_usage {
+	kuid_t uid;
+	u64 used;		/* Nodes searched in the current window */
+	unsigned long start;	/* jiffies when the window began */
+	bool valid;
+};
+
+// A search waiting for a slot
+struct slot_waiter {
+	struct list_head list;
+	kuid_t uid;
+	bool granted;
+};
+
+static DEFINE_SPINLOCK(sched_lock);	/* Protects everything below */
+static LIST_HEAD(sched_waiters);
+static int sched_running;		/* Slots taken */
+static struct uid_usage uid_usage[UID_SLOTS];
+static DECLARE_WAIT_QUEUE_HEAD(sched_wq);	/* Woken up when a slot is granted */
+
+static int pool_size;	/* Search threads, see pool_push() */
+
+static int sched_limit(void) {
+	return max_searches > 0 ? max_searches : pool_size;
+}
+
+static bool window_over(unsigned long start) {
+	return time_after_eq(jiffies, start + msecs_to_jiffies(max(budget_window, 1)));
+}
+
+/* Usage of uid in the current window. A new user takes a free entry,
+ * or the one with the oldest window. Called with sched_lock held. */
+static struct uid_usage *uid_lookup(kuid_t uid) {
+	struct uid_usage *u, *victim = NULL;
+	for (u = uid_usage; u < uid_usage + UID_SLOTS; ++u) {
+		if (u->valid && uid_eq(u->uid, uid)) {
+			break;
+		}
+		if (!victim || (victim->valid && (!u->valid || time_before(u->start, victim->start)))) {
+			victim = u;
+		}
+	}
+	if (u == uid_usage + UID_SLOTS) {
+		u = victim;
+		u->uid = uid;
+		u->valid = true;
+		u->start = jiffies;
+		u->used = 0;
+	}
+	if (window_over(u->start)) {
+		u->start = jiffies;
+		u->used = 0;
+	}
+	return u;
+}
+
+/* Hand the free slots to the waiters whose users searched least.
+ * Called with sched_lock held. */
+static void sched_grant(void) {
+	int granted = 0;
+	while (sched_running < sched_limit() && !list_empty(&sched_waiters)) {
+		struct slot_waiter *w, *next = NULL;
+		u64 least = U64_MAX;
+		list_for_each_entry(w, &sched_waiters, list) {
+			u64 used = uid_lookup(w->uid)->used;
+			// The first one in the list wins ties
+			if (!next || used < least) {
+				next = w;
+				least = used;
+			}
+		}
+		list_del(&next->list);
+		WRITE_ONCE(next->granted, true);
+		++sched_running;
+		granted = 1;
+	}
+	if (granted) {
+		wake_up_all(&sched_wq);
+	}
+}
+
+/* Take a search slot for a search charged to uid, waiting for one if
+ * they are all taken. Returns -EINTR if the caller was killed. */
+static int sched_acquire(kuid_t uid) {
+	struct slot_waiter w = { .uid = uid };
+
+	spin_lock(&sched_lock);
+	if (list_empty(&sched_waiters) && sched_running < sched_limit()) {
+		++sched_running;
+		spin_unlock(&sched_lock);
+		return 0;
+	}
+	list_add_tail(&w.list, &sched_waiters);
+	spin_unlock(&sched_lock);
+
+	if (wait_event_killable(sched_wq, READ_ONCE(w.granted))) {
+		spin_lock(&sched_lock);
+		// Granted just now, pass it on
+		if (w.granted) {
+			--sched_running;
+			sched_grant();
+		}
+		else {
+			list_del(&w.list);
+		}
+		spin_unlock(&sched_lock);
+		return -EINTR;
+	}
+	return 0;
+}
+
+// Take a slot if one is free now, for a search that can be skipped
+static int sched_try_acquire(void) {
+	int ok = 0;
+	spin_lock(&sched_lock);
+	if (list_empty(&sched_waiters) && sched_running < sched_limit()) {
+		++sched_running;
+		ok = 1;
+	}
+	spin_unlock(&sched_lock);
+	return ok;
+}
+
+static void sched_release(void) {
+	spin_lock(&sched_lock);
+	--sched_running;
+	sched_grant();
+	spin_unlock(&sched_lock);
+}
+
+/* Nodes the next search of game d_num may use: what is left of the
+ * game's and its user's budget. Called with the game lock held. */
+static u64 budget_allowance(int d_num) {
+	struct d_data *game = &cdev_data[d_num];
+	u64 left = U64_MAX;
+	if (game_budget) {
+		if (window_over(game->budget_start)) {
+			game->budget_start = jiffies;
+			game->budget_used = 0;
+		}
+		left = game_budget > game->budget_used ? game_budget - game->budget_used : 0;
+	}
+	if (uid_budget) {
+		spin_lock(&sched_lock);
+		u64 used = uid_lookup(game->uid)->used;
+		spin_unlock(&sched_lock);
+		left = min_t(u64, left, uid_budget > used ? uid_budget - used : 0);
+	}
+	return max_t(u64, left, BUDGET_MIN_NODES);
+}
+
+// Charge nodes searched by game d_num to it and to its user
+static void budget_charge(int d_num, u64 nodes) {
+	struct d_data *game = &cdev_data[d_num];
+	if (window_over(game->budget_start)) {
+		game->budget_start = jiffies;
+		game->budget_used = 0;
+	}
+	game->budget_used += nodes;
+	spin_lock(&sched_lock);
+	uid_lookup(game->uid)->used += nodes;
+	spin_unlock(&sched_lock);
+}
+
+/* Every search runs on a pool of search threads, one bound to each
+ * CPU that was online when the module was loaded. A thread has a
+ * deque of searches: searches are queued on the thread of the CPU that
+ * asks for them (or of a CPU on the game's node). The thread runs the
+ * newest one first, while its memory is still warm in that CPU's
+ * caches. An idle thread steals the oldest search of another thread,
+ * from its own node first. Each job holds a search slot, see
+ * sched_acquire(), and gives it back when its search ends. */
+struct search_worker {
+	spinlock_t lock;	/* Protects jobs */
+	struct list_head jobs;	/* Oldest first */
+	struct task_struct *task;
+	int cpu;
+	int node;
+} ____cacheline_aligned_in_smp;
+
+static struct search_worker *pool;
+static int *pool_of_cpu;	/* Search thread of each CPU, -1 for none */
+static atomic_t pool_queued;	/* Jobs on all the deques */
+static DECLARE_WAIT_QUEUE_HEAD(pool_wq);	/* Idle search threads */
+
+/* Queue a search of game d_num, its search state in job->s is set up.
+ * job->done is completed when the search ends. */
+static void pool_push(int d_num, struct search_job *job) {
+	int node = numa ? cdev_data[d_num].node : NUMA_NO_NODE;
+	struct search_worker *w;
+	int i = pool_of_cpu[get_cpu()];
+
+	// Keep the game on its node, where its search memory is
+	if (i < 0 || (node != NUMA_NO_NODE && pool[i].node != node)) {
+		int k, start = max(i, 0);
+		for (k = 0; k < pool_size; ++k) {
+			if (node == NUMA_NO_NODE || pool[(start + k) % pool_size].node == node) {
+				break;
+			}
+		}
+		i = k < pool_size ? (start + k) % pool_size : start;
+	}
+	put_cpu();
+
+	w = &pool[i];
+	reinit_completion(&job->done);
+	spin_lock(&w->lock);
+	list_add_tail(&job->list, &w->jobs);
+	spin_unlock(&w->lock);
+	atomic_inc(&pool_queued);
+	wake_up(&pool_wq);
+}
+
+// Take the newest job of w, or steal the oldest job of another thread
+static struct search_job *pool_take(struct search_worker *w) {
+	struct search_job *job = NULL;
+	int pass, k;
+
+	spin_lock(&w->lock);
+	if (!list_empty(&w->jobs)) {
+		job = list_last_entry(&w->jobs, struct search_job, list);
+		list_del(&job->list);
+	}
+	spin_unlock(&w->lock);
+
+	// Threads on the same node first, then the others
+	for (pass = 0; pass < 2 && !job; ++pass) {
+		for (k = 1; k < pool_size && !job; ++k) {
+			struct search_worker *v = &pool[(w - pool + k) % pool_size];
+			if ((v->node == w->node) != (pass == 0) || list_empty(&v->jobs)) {
+				continue;
+			}
+			spin_lock(&v->lock);
+			if (!list_empty(&v->jobs)) {
+				job = list_first_entry(&v->jobs, struct search_job, list);
+				list_del(&job->list);
+			}
+			spin_unlock(&v->lock);
+		}
+	}
+	if (job) {
+		atomic_dec(&pool_queued);
+	}
+	return job;
+}
+
+static int pool_thread(void *arg) {
+	struct search_worker *w = arg;
+
+	while (!kthread_should_stop()) {
+		struct search_job *job = pool_take(w);
+		if (!job) {
+			wait_event_interruptible_exclusive(pool_wq, atomic_read(&pool_queued) ||
+							   kthread_should_stop());
+			continue;
+		}
+		iterate(job->s);
+		sched_release();
+		complete(&job->done);
+	}
+	return 0;
+}
+
+// Start a search thread on each online CPU
+static int pool_start(void) {
+	int cpu, i;
+
+	pool_of_cpu = kmalloc_array(nr_cpu_ids, sizeof(*pool_of_cpu), GFP_KERNEL);
+	pool = kcalloc(num_online_cpus(), sizeof(*pool), GFP_KERNEL);
+	if (!pool_of_cpu || !pool) {
+		return -ENOMEM;
+	}
+	for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
+		pool_of_cpu[cpu] = -1;
+	}
+	for_each_online_cpu(cpu) {
+		// A CPU that came online meanwhile has no room
+		if (pool_size == num_online_cpus()) {
+			break;
+		}
+		struct search_worker *w = &pool[pool_size];
+		spin_lock_init(&w->lock);
+		INIT_LIST_HEAD(&w->jobs);
+		w->cpu = cpu;
+		w->node = cpu_to_node(cpu);
+		w->task = kthread_create_on_node(pool_thread, w, w->node, "chess/%d", cpu);
+		if (IS_ERR(w->task)) {
+			break;
+		}
+		kthread_bind(w->task, cpu);
+		pool_of_cpu[cpu] = pool_size++;
+	}
+	if (!pool_size) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < pool_size; ++i) {
+		wake_up_process(pool[i].task);
+	}
+	return 0;
+}
+
+// Stop the search threads, once no game is searching
+static void pool_stop(void) {
+	int i;
+	for (i = 0; i < pool_size; ++i) {
+		kthread_stop(pool[i].task);
+	}
+	kfree(pool);
+	kfree(pool_of_cpu);
+}
+
+/* Wait for a search slot without holding up the game: the game lock
+ * is dropped meanwhile. Returns 1, without a slot, if the caller was
+ * killed or the game was reset from generation. */
+static int search_slot(int d_num, unsigned int generation) {
+	struct d_data *game = &cdev_data[d_num];
+	mutex_unlock(&game->lock);
+	int waited = sched_acquire(game->uid);
+	mutex_lock(&game->lock);
+	if (waited) {
+		return 1;
+	}
+	if (game->generation != generation) {
+		sched_release();
+		return 1;
+	}
+	return 0;
+}
+
+/* Run search s, set up and holding a slot, on the pool and wait for
+ * it. Other commands on this game get in while the pool searches:
+ * resetting the game stops the search. A killed caller stops it too,
+ * but still waits until the search thread lets go of it. */
+static void pool_search(int d_num, struct search_t *s) {
+	struct search_job job = { .s = s };
+	init_completion(&job.done);
+	mutex_unlock(&cdev_data[d_num].lock);
+	pool_push(d_num, &job);
+	if (wait_for_completion_killable(&job.done)) {
+		WRITE_ONCE(s->stop, 1);
+		wait_for_completion(&job.done);
+	}
+	mutex_lock(&cdev_data[d_num].lock);
+}
+
+/* Pick the CPU move for the current position and store it in *best.
+ * Called with the game lock held. The lock is dropped while the search
+ * runs on the pool, so the game may be reset ("00") while we think.
+ * With multipv set the search ranks that many best moves for "06"
+ * in s->pv_moves instead.
+ * Returns -ENOMEM if the engine is unavailable, -EINTR if the caller
+ * was killed and -ECANCELED if the game was reset. */
+static int think(int d_num, char color, move_t *best, int multipv) {
+	struct d_data *game = &cdev_data[d_num];
+	struct search_t *s = game->search;
+	unsigned int generation = game->generation;
+	int ret = 0;
+
+	*best = NO_MOVE;
+	game->searching = 1;
+
+	/* A ponder search on this very position is the search we want,
+	 * give it the move time and let it finish. It is ours from now on:
+	 * with pondering cleared stop_ponder() leaves it alone, and like
+	 * any search of ours "00" stops it through searching. */
+	if (game->pondering && game->ponder_key == game->pos.key && !multipv) {
+		if (game->move_time > 0) {
+			hrtimer_start(&s->timer, ms_to_ktime(game->move_time), HRTIMER_MODE_REL);
+		}
+		game->pondering = 0;
+		mutex_unlock(&game->lock);
+		// A killed caller does not wait for the whole search
+		if (wait_for_completion_killable(&game->ponder_job.done)) {
+			WRITE_ONCE(s->stop, 1);
+			wait_for_completion(&game->ponder_job.done);
+		}
+		mutex_lock(&game->lock);
+		hrtimer_cancel(&s->timer);
+		++game->ponder_hits;
+		game->nodes += s->nodes;
+		budget_charge(d_num, s->nodes);
+		*best = s->best;
+		if (*best != NO_MOVE) {
+			goto done;
+		}
+	}
+	else {
+		stop_ponder(d_num);
+	}
+
+	if (engine_alloc(d_num)) {
+		ret = -ENOMEM;
+		goto done;
+	}
+	s = game->search;
+
+	// Answer straight from the hash table if it was searched deep enough
+	struct tt_entry *e = &game->tt[game->pos.key & game->tt_mask];
+	if (!multipv && e->key == game->pos.key && e->flag == TT_EXACT &&
+	    e->depth >= search_depth && move_legal(&game->pos, color, e->move)) {
+		*best = e->move;
+		goto done;
+	}
+
+	if (search_slot(d_num, generation)) {
+		goto done;
+	}
+
+	s->pos = game->pos;
+	s->color = color;
+	s->max_depth = clamp(search_depth, 1, MAX_PLY - 1);
+	s->features = game->features;
+	s->multipv = multipv;
+	s->pv_count = 0;
+	s->max_nodes = budget_allowance(d_num);
+	WRITE_ONCE(s->stop, 0);
+	if (game->move_time > 0) {
+		hrtimer_start(&s->timer, ms_to_ktime(game->move_time), HRTIMER_MODE_REL);
+	}
+
+	pool_search(d_num, s);
+	hrtimer_cancel(&s->timer);
+	game->nodes += s->nodes;
+	budget_charge(d_num, s->nodes);
+
+	// Out of time before the first iteration finished
+	*best = s->best != NO_MOVE ? s->best : s->root_best;
+done:
+	if (fatal_signal_pending(current)) {
+		ret = -EINTR;
+	}
+	else if (game->generation != generation) {
+		ret = -ECANCELED;
+	}
+	game->searching = 0;
+	wake_up_all(&game->wq);
+	return ret;
+}
+
+// Run work of a game on the workers of its node
+static void queue_game_work(int d_num, struct work_struct *work) {
+	int node = cdev_data[d_num].node;
+	if (node != NUMA_NO_NODE) {
+		queue_work_node(node, chess_wq, work);
+	}
+	else {
+		queue_work(chess_wq, work);
+	}
+}
+
+/* A new game was started by a task on node: move the search memory
+ * there. It is freed now and allocated again by the first search.
+ * Called with the game lock held. */
+static void set_game_node(int d_num, int node) {
+	struct d_data *game = &cdev_data[d_num];
+	// A cancelled search may still be using it, try again next game
+	if (!numa || game->node == node || game->searching || game->pondering) {
+		return;
+	}
+	engine_free(d_num);
+	game->node = node;
+}
+
+/* Charge the memory the game allocates from now on to the memory
+ * cgroup of the task that starts it, so that a tenant cannot pin
+ * kernel memory outside its limits. Called with the game lock held. */
+static void set_game_memcg(int d_num) {
+	struct d_data *game = &cdev_data[d_num];
+	struct mem_cgroup *memcg = get_mem_cgroup_from_mm(current->mm);
+	mem_cgroup_put(game->memcg);
+	game->memcg = memcg;
+}
+
+/* Under memory pressure the shrinker frees the search memory of idle
+ * games, the least recently used first; their next search allocates
+ * it again, with an empty hash table. The move logs are the record of
+ * the games and are kept. Counted in pages. */
+static unsigned long chess_shrink_count(struct shrinker *shrink, struct shrink_control *sc) {
+	unsigned long pages = 0;
+	int i;
+	for (i = 0; i < devices; ++i) {
+		struct d_data *game = &cdev_data[i];
+		if (READ_ONCE(game->searching) || READ_ONCE(game->pondering)) {
+			continue;
+		}
+		if (READ_ONCE(game->tt)) {
+			pages += DIV_ROUND_UP((READ_ONCE(game->tt_mask) + 1) * sizeof(struct tt_entry),
+					      PAGE_SIZE);
+		}
+		if (READ_ONCE(game->search)) {
+			pages += DIV_ROUND_UP(sizeof(struct search_t), PAGE_SIZE);
+		}
+	}
+	return pages ? pages : SHRINK_EMPTY;
+}
+
+static unsigned long chess_shrink_scan(struct shrinker *shrink, struct shrink_control *sc) {
+	// Games idle for a minute go first, then ever more recent ones
+	static const unsigned int idle_ms[] = { 60000, 10000, 1000, 0 };
+	unsigned long freed = 0;
+	int k, i;
+
+	for (k = 0; k < ARRAY_SIZE(idle_ms) && freed < sc->nr_to_scan; ++k) {
+		for (i = 0; i < devices && freed < sc->nr_to_scan; ++i) {
+			struct d_data *game = &cdev_data[i];
+			if (!READ_ONCE(game->tt) && !READ_ONCE(game->search)) {
+				continue;
+			}
+			if (time_before(jiffies, READ_ONCE(game->last_used) + msecs_to_jiffies(idle_ms[k]))) {
+				continue;
+			}
+			// Never wait for a game, the allocation that needs the memory may hold its lock
+			if (!mutex_trylock(&game->lock)) {
+				continue;
+			}
+			freed += engine_free(i);
+			mutex_unlock(&game->lock);
+		}
+	}
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker chess_shrinker = {
+	.count_objects	= chess_shrink_count,
+	.scan_objects	= chess_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+static bool shrinker_registered;
+
+/* Guess the player's reply from the hash table and start searching
+ * the position after it in the background. Called with the game lock held. */
+static void start_ponder(int d_num) {
+	struct d_data *game = &cdev_data[d_num];
+	struct search_t *s = game->search;
+
+	if (!game->ponder || !game->game_on || !s || game->pondering) {
+		return;
+	}
+	// Guessing is for games within budget, and only in a free slot
+	u64 allowance = budget_allowance(d_num);
+	if (allowance <= BUDGET_MIN_NODES) {
+		return;
+	}
+	struct tt_entry *e = &game->tt[game->pos.key & game->tt_mask];
+	if (e->key != game->pos.key ||
+	    !move_legal(&game->pos, game->player_color, e->move) ||
+	    !sched_try_acquire()) {
+		return;
+	}
+
+	s->pos = game->pos;
+	do_move(&s->pos, e->move, &s->undo[0]);
+	s->color = game->computer_color;
+	s->max_depth = clamp(search_depth, 1, MAX_PLY - 1);
+	s->features = game->features;
+	s->multipv = 0;
+	s->max_nodes = allowance;
+	WRITE_ONCE(s->stop, 0);
+	game->ponder_key = s->pos.key;
+	game->pondering = 1;
+	game->ponder_job.s = s;
+	pool_push(d_num, &game->ponder_job);
+}
+
+// Abandon a ponder search and wait for the search thread to let go of it
+static void stop_ponder(int d_num) {
+	struct d_data *game = &cdev_data[d_num];
+	if (!game->pondering) {
+		return;
+	}
+	WRITE_ONCE(game->search->stop, 1);
+	wait_for_completion(&game->ponder_job.done);
+	game->pondering = 0;
+	budget_charge(d_num, game->search->nodes);
+}
+
+// Make a "03" that is thinking about the old game give up
+static void reset_search(int d_num) {
+	struct d_data *game = &cdev_data[d_num];
+	++game->generation;
+	if (game->searching) {
+		WRITE_ONCE(game->search->stop, 1);
+	}
+}
+
+// Remember how long a CPU move took
+static void record_move_time(int d_num, ktime_t start) {
+	struct d_data *game = &cdev_data[d_num];
+	s64 us = ktime_us_delta(ktime_get(), start);
+	game->move_us[game->cpu_moves % MOVE_SAMPLES] = min_t(s64, us, U32_MAX);
+	++game->cpu_moves;
+}
+
+/* Latency of every command, by command, phase and log2 of the time.
+ * Each CPU counts in its own copy, so recording takes no lock and
+ * shares no cache line; the latency file in debugfs adds them up. */
+struct latency_hist {
+	u64 n[HIST_CMDS][HIST_PHASES][HIST_BUCKETS];
+};
+static DEFINE_PER_CPU(struct latency_hist, latency_hist);
+
+static int hist_bucket(ktime_t from, ktime_t to) {
+	s64 ns = ktime_to_ns(ktime_sub(to, from));
+	return ns > 1 ? min(ilog2(ns), HIST_BUCKETS - 1) : 0;
+}
+
+/* Count a command of type cmd ("0cmd") that was written at start, got
+ * the game lock at locked and replied at end */
+static void hist_record(int cmd, ktime_t start, ktime_t locked, ktime_t end) {
+	if (cmd < 0 || cmd >= HIST_CMDS) {
+		return;
+	}
+	this_cpu_inc(latency_hist.n[cmd][HIST_WAIT][hist_bucket(start, locked)]);
+	this_cpu_inc(latency_hist.n[cmd][HIST_RUN][hist_bucket(locked, end)]);
+	this_cpu_inc(latency_hist.n[cmd][HIST_TOTAL][hist_bucket(start, end)]);
+}
+
+/* Start the move log of a new game, played from the usual starting
+ * position or from fen. Called with the game lock held. */
+static void log_reset(int d_num, const char *fen) {
+	struct d_data *game = &cdev_data[d_num];
+	kfree(game->log_fen);
+	game->log_fen = NULL;
+	game->log_len = 0;
+	game->log_full = 0;
+	game->result = RESULT_NONE;
+	game->self_play = 0;
+	if (fen) {
+		struct mem_cgroup *old = set_active_memcg(game->memcg);
+		game->log_fen = kstrdup(fen, GFP_KERNEL_ACCOUNT);
+		set_active_memcg(old);
+		// Moves from an unknown position are no use
+		game->log_full = !game->log_fen;
+	}
+}
+
+// Add a move of the game to its log, which grows as needed
+static void log_move(int d_num, move_t m) {
+	struct d_data *game = &cdev_data[d_num];
+	if (game->log_full) {
+		return;
+	}
+	if (game->log_len == game->log_size) {
+		u32 size = max(2 * game->log_size, 64U);
+		struct mem_cgroup *old = set_active_memcg(game->memcg);
+		move_t *log = krealloc(game->log, size * sizeof(*log), GFP_KERNEL_ACCOUNT);
+		set_active_memcg(old);
+		if (!log) {
+			game->log_full = 1;
+			return;
+		}
+		game->log = log;
+		game->log_size = size;
+	}
+	game->log[game->log_len++] = m;
+}
+
+// The game is over, won by color
+static void set_result(int d_num, char color) {
+	cdev_data[d_num].result = color == 'W' ? RESULT_WHITE : RESULT_BLACK;
+}
+
+/* color has no legal move: end the game, as a loss if color is in
+ * check, else as a draw, and reply MATE or STALEMATE */
+static void game_stuck(int d_num, char color) {
+	struct d_data *game = &cdev_data[d_num];
+	game->game_on = 0;
+	if (in_check(&game->pos, color)) {
+		set_result(d_num, color == 'W' ? 'B' : 'W');
+		char reply[] = "MATE\n\0";
+		strcpy(game->reply, reply);
+	}
+	else {
+		game->result = RESULT_DRAW;
+		char reply[] = "STALEMATE\n\0";
+		strcpy(game->reply, reply);
+	}
+}
+
+/* Search features that "05 name=0/1" switches */
+static const struct {
+	const char *name;
+	u8 flag;
+} search_options[] = {
+	{ "nullmove", SEARCH_NULL },
+	{ "lmr", SEARCH_LMR },
+	{ "pvs", SEARCH_PVS },
+	{ "aspiration", SEARCH_ASPIRATION },
+};
+
+/* Handle "05 name=value". Called with the game lock held. */
+static int set_option(int d_num, char *arg) {
+	char *value = strchr(arg, '=');
+	int v;
+	if (value == NULL) {
+		return -EINVAL;
+	}
+	*value++ = '\0';
+	if (kstrtoint(value, 10, &v)) {
+		return -EINVAL;
+	}
+
+	if (strcmp(arg, "ponder") == 0) {
+		if (v != 0 && v != 1) {
+			return -EINVAL;
+		}
+		cdev_data[d_num].ponder = v;
+		if (!v) {
+			stop_ponder(d_num);
+		}
+	}
+	else if (strcmp(arg, "time") == 0) {
+		if (v < 0) {
+			return -EINVAL;
+		}
+		cdev_data[d_num].move_time = v;
+	}
+	else {
+		int i;
+		for (i = 0; i < ARRAY_SIZE(search_options); ++i) {
+			if (strcmp(arg, search_options[i].name) == 0) {
+				break;
+			}
+		}
+		if (i == ARRAY_SIZE(search_options) || (v != 0 && v != 1)) {
+			return -EINVAL;
+		}
+		if (v) {
+			cdev_data[d_num].features |= search_options[i].flag;
+		}
+		else {
+			cdev_data[d_num].features &= ~search_options[i].flag;
+		}
+	}
+	return 0;
+}
+
+/* Wait for a search on this game to finish. Called with the game lock
+ * held; returns -EINTR, with the lock dropped, if the caller was killed. */
+static int wait_search(int d_num) {
+	struct d_data *game = &cdev_data[d_num];
+	while (game->searching) {
+		mutex_unlock(&game->lock);
+		if (wait_event_killable(game->wq, !READ_ONCE(game->searching))) {
+			return -EINTR;
+		}
+		mutex_lock(&game->lock);
+	}
+	return 0;
+}
+
+/* Play the CPU move of "03" and set the reply. Called with the game
+ * lock held, which think() drops while searching. Returns -EINTR or
+ * -ECANCELED, leaving the reply alone, if the caller was killed or
+ * the game was reset while thinking. */
+static int cpu_move(int d_num) {
+	if (cdev_data[d_num].game_on != 1) {
+		char err[] = "NOGAME\n\0";
+		strcpy(cdev_data[d_num].reply, err);
+		return 0;
+	}
+	if (cdev_data[d_num].turn != cdev_data[d_num].computer_color) {
+		char err[] = "OOT\n\0";
+		strcpy(cdev_data[d_num].reply, err);
+		return 0;
+	}
+	/* Search for the best move. If the engine could not
+	be set up, fall back to the first legal move */
+	ktime_t start = ktime_get();
+	move_t best;
+	int err = think(d_num, cdev_data[d_num].computer_color, &best, 0);
+	// Killed or reset while thinking, the move is not wanted any more
+	if (err == -EINTR || err == -ECANCELED) {
+		return err;
+	}
+	record_move_time(d_num, start);
+	if (best == NO_MOVE) {
+		// Without a search play the first legal move, if there is one
+		move_t moves[MAX_MOVES];
+		if (!legal_moves(&cdev_data[d_num].pos, cdev_data[d_num].computer_color, moves)) {
+			game_stuck(d_num, cdev_data[d_num].computer_color);
+			return 0;
+		}
+		best = moves[0];
+	}
+	struct undo_t u;
+	do_move(&cdev_data[d_num].pos, best, &u);
+	log_move(d_num, best);
+	cdev_data[d_num].turn = cdev_data[d_num].player_color;
+
+	// Check of the CPU has put the player in check
+	int check = in_check(&cdev_data[d_num].pos, cdev_data[d_num].player_color);
+	// Without a valid player move it is checkmate or stalemate
+	if (make_move(&cdev_data[d_num].pos, cdev_data[d_num].player_color, 1)) {
+		game_stuck(d_num, cdev_data[d_num].player_color);
+		return 0;
+	}
+	if (check) {
+		char reply[] = "CHECK\n\0";
+		strcpy(cdev_data[d_num].reply, reply);
+	}
+	else {
+		char reply[] = "OK\n\0";
+		strcpy(cdev_data[d_num].reply, reply);
+	}
+	// Think about the player's reply while waiting for it
+	start_ponder(d_num);
+	return 0;
+}
+
+/* Write move m of the side to move in the notation of "02", with the
+ * capture and promotion options, e.g. "WPe7-d8xBRyWQ". Returns the length. */
+static int move_text(position_t *pos, move_t m, char *buf) {
+	int from = MOVE_FROM(m);
+	int to = MOVE_TO(m);
+	piece_t *p = &pos->figures[pos->board[from]];
+	int n = sprintf(buf, "%c%c%c%c-%c%c", p->color, type_letter[p->type],
+			'a' + from % 8, '1' + from / 8, 'a' + to % 8, '1' + to / 8);
+
+	if (pos->board[to] != -1) {
+		piece_t *q = &pos->figures[pos->board[to]];
+		n += sprintf(buf + n, "x%c%c", q->color, type_letter[q->type]);
+	}
+	if (MOVE_PROMO(m)) {
+		n += sprintf(buf + n, "y%c%c", p->color, type_letter[MOVE_PROMO(m)]);
+	}
+	return n;
+}
+
+/* Write move m of color in standard algebraic notation, as PGN has it,
+ * e.g. "Nbd7", "exd5" or "e8=Q#". Returns the length. */
+static int move_san(position_t *pos, char color, move_t m, char *buf) {
+	int from = MOVE_FROM(m);
+	int to = MOVE_TO(m);
+	int type = pos->figures[pos->board[from]].type;
+	int capture = pos->board[to] != -1;
+	char enemy = color == 'W' ? 'B' : 'W';
+	struct undo_t u;
+	int n = 0;
+
+	if (type == PAWN) {
+		if (capture) {
+			buf[n++] = 'a' + from % 8;
+		}
+	}
+	else {
+		// Name the square the piece comes from if another one could go there too
+		move_t moves[MAX_MOVES];
+		int count = legal_moves(pos, color, moves);
+		int other = 0, same_file = 0, same_rank = 0;
+		int k;
+		for (k = 0; k < count; ++k) {
+			int f = MOVE_FROM(moves[k]);
+			if (MOVE_TO(moves[k]) == to && f != from &&
+			    pos->figures[pos->board[f]].type == type) {
+				other = 1;
+				same_file |= f % 8 == from % 8;
+				same_rank |= f / 8 == from / 8;
+			}
+		}
+		buf[n++] = type_letter[type];
+		if (other && (!same_file || same_rank)) {
+			buf[n++] = 'a' + from % 8;
+		}
+		if (other && same_file) {
+			buf[n++] = '1' + from / 8;
+		}
+	}
+	if (capture) {
+		buf[n++] = 'x';
+	}
+	buf[n++] = 'a' + to % 8;
+	buf[n++] = '1' + to / 8;
+	if (MOVE_PROMO(m)) {
+		buf[n++] = '=';
+		buf[n++] = type_letter[MOVE_PROMO(m)];
+	}
+
+	do_move(pos, m, &u);
+	if (in_check(pos, enemy)) {
+		buf[n++] = make_move(pos, enemy, 1) ? '#' : '+';
+	}
+	undo_move(pos, &u);
+	buf[n] = '\0';
+	return n;
+}
+
+/* Search the best n_pv moves of the side to move for "06" and list them
+ * in the reply. Called with the game lock held, like cpu_move(), and
+ * returns -EINTR or -ECANCELED the same way. */
+static int analyse(int d_num, int n_pv) {
+	struct d_data *game = &cdev_data[d_num];
+	move_t best;
+	int i, len;
+
+	if (game->game_on != 1) {
+		char err[] = "NOGAME\n\0";
+		strcpy(game->reply, err);
+		return 0;
+	}
+	int err = think(d_num, game->turn, &best, n_pv);
+	if (err == -EINTR || err == -ECANCELED) {
+		return err;
+	}
+	if (err) {
+		char resp[] = "NOMEM\n\0";
+		strcpy(game->reply, resp);
+		return 0;
+	}
+
+	// "DEPTH d", then a move and its score per line, best first
+	struct search_t *s = game->search;
+	len = sprintf(game->reply, "DEPTH %d\n", s->depth);
+	for (i = 0; i < s->pv_count; ++i) {
+		int score = s->pv_scores[i];
+		len += move_text(&game->pos, s->pv_moves[i], game->reply + len);
+		// Mates are shown as "#n" moves, "#-n" when getting mated
+		if (score > MATE - MAX_PLY) {
+			len += sprintf(game->reply + len, " #%d\n", (MATE - score + 1) / 2);
+		}
+		else if (score < -MATE + MAX_PLY) {
+			len += sprintf(game->reply + len, " #-%d\n", (MATE + score) / 2);
+		}
+		else {
+			len += sprintf(game->reply + len, " %d\n", score);
+		}
+	}
+	if (game->turn == game->player_color) {
+		start_ponder(d_num);
+	}
+	return 0;
+}
+
+// Pick one of the legal moves of color at random, NO_MOVE if there is none
+static move_t random_move(position_t *pos, char color) {
+	move_t moves[MAX_MOVES];
+	int n = legal_moves(pos, color, moves);
+	return n ? moves[get_random_u32() % n] : NO_MOVE;
+}
+
+/* Play "07" games of the engine against itself and reply with the
+ * games per second, the nodes per move and how the games ended. The
+ * games are played on the board of this game, with its options and
+ * hash table, and end any game in progress. Called with the game lock
+ * held, like cpu_move(); "00" stops the games. */
+static int self_play(int d_num, int games, int max_plies) {
+	struct d_data *game = &cdev_data[d_num];
+	ktime_t start = ktime_get();
+	u64 nodes = game->nodes;
+	unsigned int moves = 0;
+	unsigned int wins[2] = { 0, 0 };	/* White, black */
+	unsigned int stalemates = 0;
+	unsigned int unfinished = 0;
+	char color = 'W';
+	int g, ply;
+
+	stop_ponder(d_num);
+	if (engine_alloc(d_num)) {
+		char resp[] = "NOMEM\n\0";
+		strcpy(game->reply, resp);
+		return 0;
+	}
+	// Other commands see no game until we are done
+	game->game_on = 0;
+	for (g = 0; g < games; ++g) {
+		// Every game starts afresh, without the previous game's hash table
+		color = load_position(&game->pos, START_FEN);
+		memset(game->tt, 0, (game->tt_mask + 1) * sizeof(*game->tt));
+		log_reset(d_num, NULL);
+		game->self_play = 1;
+		for (ply = 0; ply < max_plies; ++ply) {
+			struct undo_t u;
+			move_t m;
+			if (make_move(&game->pos, color, 1)) {
+				if (in_check(&game->pos, color)) {
+					++wins[color == 'W'];
+					set_result(d_num, color == 'W' ? 'B' : 'W');
+				}
+				else {
+					++stalemates;
+					game->result = RESULT_DRAW;
+				}
+				break;
+			}
+			if (ply < SELF_PLAY_RANDOM) {
+				m = random_move(&game->pos, color);
+			}
+			else {
+				int err = think(d_num, color, &m, 0);
+				if (err == -EINTR || err == -ECANCELED) {
+					return err;
+				}
+				++moves;
+			}
+			// Out of time before the first move was searched
+			if (m == NO_MOVE) {
+				m = random_move(&game->pos, color);
+			}
+			do_move(&game->pos, m, &u);
+			log_move(d_num, m);
+			color = color == 'W' ? 'B' : 'W';
+		}
+		if (ply == max_plies) {
+			++unfinished;
+		}
+		cond_resched();
+	}
+	game->turn = color;
+
+	s64 us = max_t(s64, ktime_us_delta(ktime_get(), start), 1);
+	u64 rate = div64_u64((u64)games * 100 * USEC_PER_SEC, us);	/* Games per 100 s */
+	snprintf(game->reply, sizeof(game->reply),
+		 "GAMES %d %llu.%02llu/s\nWHITE %u BLACK %u STALEMATE %u LIMIT %u\n"
+		 "MOVES %u NODES/MOVE %llu\n", games, rate / 100, rate % 100,
+		 wins[0], wins[1], stalemates, unfinished,
+		 moves, div64_u64(game->nodes - nodes, max(moves, 1U)));
+	return 0;
+}
+
+/* Positions "08" searches: the opening, middlegames full of tactics
+ * and promotions, and endgames, so that move ordering, evaluation and
+ * the hash table all take part */
+static const char *const bench_positions[] = {
+	START_FEN,
+	"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w",
+	"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w",
+	"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w",
+	"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w",
+	"4rrk1/pp1n3p/3q2pQ/2p1pb2/2PP4/2P3N1/P2B2PP/4RRK1 b",
+	"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w",
+	"6k1/6p1/6Pp/ppp5/3pn2P/1P3K2/1PP2P2/8 b",
+};
+
+/* Search every bench position to depth plies and reply with the
+ * nodes, the time and the nodes per second. Each search starts from an
+ * empty hash table with all search features on and no time limit, so
+ * the node counts only depend on the search code and the hash_kb
+ * parameter. The signature hashes them with the best moves: a build
+ * that searches differently shows a different one. The game in
+ * progress is kept but loses its hash table. Called with the game lock
+ * held, like cpu_move(). */
+static int bench(int d_num, int depth) {
+	struct d_data *game = &cdev_data[d_num];
+	unsigned int generation = game->generation;
+	struct search_t *s;
+	u64 nodes = 0;
+	u64 signature = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	s64 us = 0;
+	int i;
+
+	stop_ponder(d_num);
+	if (engine_alloc(d_num)) {
+		char resp[] = "NOMEM\n\0";
+		strcpy(game->reply, resp);
+		return 0;
+	}
+	s = game->search;
+	game->searching = 1;
+	for (i = 0; i < ARRAY_SIZE(bench_positions); ++i) {
+		if (search_slot(d_num, generation)) {
+			break;
+		}
+		s->color = load_position(&s->pos, bench_positions[i]);
+		memset(game->tt, 0, (game->tt_mask + 1) * sizeof(*game->tt));
+		s->max_depth = depth;
+		s->features = SEARCH_ALL;
+		s->multipv = 0;
+		s->pv_count = 0;
+		// A search cut short by the budget would not count the same nodes
+		s->max_nodes = budget_allowance(d_num);
+		WRITE_ONCE(s->stop, 0);
+
+		ktime_t start = ktime_get();
+		pool_search(d_num, s);
+		us += ktime_us_delta(ktime_get(), start);
+		game->nodes += s->nodes;
+		budget_charge(d_num, s->nodes);
+		if (READ_ONCE(s->stop)) {
+			break;
+		}
+		nodes += s->nodes;
+		signature = (signature ^ s->nodes) * 0x100000001b3ULL;
+		signature = (signature ^ s->best) * 0x100000001b3ULL;
+	}
+	game->searching = 0;
+	wake_up_all(&game->wq);
+	if (fatal_signal_pending(current)) {
+		return -EINTR;
+	}
+	if (game->generation != generation) {
+		return -ECANCELED;
+	}
+	if (i < ARRAY_SIZE(bench_positions)) {
+		char err[] = "NOBUDGET\n\0";
+		strcpy(game->reply, err);
+		return 0;
+	}
+
+	us = max_t(s64, us, 1);
+	snprintf(game->reply, sizeof(game->reply),
+		 "POSITIONS %d DEPTH %d\nNODES %llu TIME %lld ms NPS %llu\nSIGNATURE %016llx\n",
+		 (int)ARRAY_SIZE(bench_positions), depth, nodes, us / USEC_PER_MSEC,
+		 div64_u64(nodes * USEC_PER_SEC, us), signature);
+	return 0;
+}
+
+/* Run "03", "06", "07" or "08" in the background. Called with the game lock
+ * held, work_arg must be set. info is the netlink request it came from,
+ * NULL if it was written to the device. */
+static void queue_move_work(int d_num, u8 cmd, struct genl_info *info) {
+	atomic_inc(&cdev_data[d_num].pending);
+	cdev_data[d_num].work_cmd = cmd;
+	cdev_data[d_num].work_portid = info ? info->snd_portid : 0;
+	cdev_data[d_num].work_seq = info ? info->snd_seq : 0;
+	cdev_data[d_num].work_start = ktime_get();
+	queue_game_work(d_num, &cdev_data[d_num].move_work);
+}
+
+// Run a "03", "06", "07" or "08" written to a non-blocking descriptor or sent over netlink
+static void move_work_fn(struct work_struct *work) {
+	struct d_data *game = container_of(work, struct d_data, move_work);
+	int d_num = game - cdev_data;
+
+	mutex_lock(&game->lock);
+	// Another command is already thinking, wait for it to finish.
+	// A kworker is never killed, so the lock is always taken again
+	wait_search(d_num);
+	ktime_t locked = ktime_get();
+	game->last_used = jiffies;
+	int err;
+	if (game->work_cmd == 6) {
+		err = analyse(d_num, game->work_arg[0]);
+	}
+	else if (game->work_cmd == 7) {
+		err = self_play(d_num, game->work_arg[0], game->work_arg[1]);
+	}
+	else if (game->work_cmd == 8) {
+		err = bench(d_num, game->work_arg[0]);
+	}
+	else {
+		err = cpu_move(d_num);
+	}
+	publish(d_num, !err);
+	if (game->work_portid && !err) {
+		nl_send(game->work_portid, game->work_seq, d_num, game->reply);
+	}
+	int cmd = game->work_cmd;
+	ktime_t start = game->work_start;
+	mutex_unlock(&game->lock);
+	command_done(d_num);
+	hist_record(cmd, start, locked, ktime_get());
+}
+
+// A command has finished, wake up readers and pollers
+static void command_done(int d_num) {
+	atomic_dec(&cdev_data[d_num].pending);
+	wake_up_interruptible(&cdev_data[d_num].reply_wq);
+}
+
+/* Show readers the board and, if replied is set, the reply of the
+ * command that just finished. Called with the game lock held. */
+static void publish(int d_num, int replied) {
+	struct d_data *game = &cdev_data[d_num];
+	write_seqlock(&game->snap_lock);
+	display_board(d_num);
+	if (replied) {
+		memcpy(game->snap_reply, game->reply, sizeof(game->reply));
+		WRITE_ONCE(game->reply_seq, game->reply_seq + 1);
+	}
+	write_sequnlock(&game->snap_lock);
+}
+
+/* "01": reply with the last published board. Needs no game lock,
+ * so viewing a game never waits for the CPU to finish thinking. */
+static void view_board(int d_num) {
+	struct d_data *game = &cdev_data[d_num];
+	write_seqlock(&game->snap_lock);
+	memcpy(game->snap_reply, game->snap_board, sizeof(game->snap_board));
+	WRITE_ONCE(game->reply_seq, game->reply_seq + 1);
+	write_sequnlock(&game->snap_lock);
+	wake_up_interruptible(&game->reply_wq);
+}
+
+// Is the message exactly "01", up to the last newline?
+static int view_request(const char *msg, size_t len) {
+	size_t n = len;
+	while (n > 0 && msg[n - 1] != '\n') {
+		--n;
+	}
+	return n == 3 && msg[0] == '0' && msg[1] == '1';
+}
+
+/* Is there a reply nobody has read yet? "NOMSG" before the first
+ * command does not count. */
+static int reply_ready(struct d_data *game) {
+	unsigned long seq = READ_ONCE(game->reply_seq);
+	return seq != 0 && seq != READ_ONCE(game->read_seq);
+}
+
+// Function definitions
+static ssize_t d_read(struct file *filp,
+		char __user *buf, size_t len, loff_t *offset) {
+
+	int d_num;
+	d_num = MINOR(filp->f_path.dentry->d_inode->i_rdev);
+	printk("Reading device: %d\n", d_num);
+
+	struct d_data *game = &cdev_data[d_num];
+	char text[sizeof(game->snap_reply)];
+	unsigned long seq, prev;
+	unsigned int snap;
+
+	if (filp->f_flags & O_NONBLOCK) {
+		if (!reply_ready(game)) {
+			return -EAGAIN;
+		}
+	}
+	// Sleep until the commands being run have replied
+	else if (wait_event_interruptible(game->reply_wq, reply_ready(game) ||
+					  !atomic_read(&game->pending))) {
+		return -ERESTARTSYS;
+	}
+
+	// Copy the last reply without the game lock
+	prev = READ_ONCE(game->read_seq);
+	do {
+		snap = read_seqbegin(&game->snap_lock);
+		seq = game->reply_seq;
+		memcpy(text, game->snap_reply, sizeof(text));
+	} while (read_seqretry(&game->snap_lock, snap));
+
+	// A reply is read once: nothing to return if it was read already
+	// or another reader takes it first
+	if (seq == prev || cmpxchg(&game->read_seq, prev, seq) != prev) {
+		return filp->f_flags & O_NONBLOCK ? -EAGAIN : 0;
+	}
+
+	int msg_len;
+	msg_len = strnlen(text, sizeof(text));
+	if (len > msg_len) {
+		len = msg_len;
 	}
-	if (__copy_to_user(buf, cdev_data[d_num].reply, len)) {
-		mutex_unlock(&d_mutex);
+	if (__copy_to_user(buf, text, len)) {
 		return -EFAULT;
 	}
-	memset(cdev_data[d_num].reply, 0, sizeof cdev_data[d_num].reply);
-	mutex_unlock(&d_mutex);
 	return len;
 }
 
 static ssize_t d_write(struct file *filp, const char __user *buf,
 		size_t len, loff_t *offset) {
-	mutex_lock(&d_mutex);
-
 	int d_num;
 	d_num = MINOR(filp->f_path.dentry->d_inode->i_rdev);
 	printk("Writing to device: %d\n", d_num);
 
-	mutex_unlock(&d_mutex);
-
 	char *msg;
 	msg = NULL;
 	msg = kmalloc(len * sizeof(*msg), GFP_KERNEL);
@@ -1181,9 +3348,65 @@ static ssize_t d_write(struct file *filp, const char __user *buf,
 		printk("Couldn't copy %zd bytes from user\n", num_failed);
 	}
 
+	// Viewing the board doesn't queue behind the game lock
+	if (num_failed == 0 && view_request(msg, len)) {
+		ktime_t start = ktime_get();
+		view_board(d_num);
+		hist_record(1, start, start, ktime_get());
+		kfree(msg);
+		return len;
+	}
+
+	ssize_t ret = run_command(d_num, msg, len, filp->f_flags & O_NONBLOCK, NULL, NULL);
+	kfree(msg);
+	return ret;
+}
+
+/* Parse and run the command in msg, len bytes up to the last newline,
+ * on game d_num. With nonblock give up with -EAGAIN while the game is
+ * busy, and queue the commands that think. info is the netlink request
+ * the command came from, NULL for the device. If reply is not NULL it
+ * gets a copy of the reply, or an empty string if there is none yet.
+ * Returns len or an error. */
+static ssize_t run_command(int d_num, char *msg, size_t len, int nonblock,
+			   struct genl_info *info, char *reply) {
+	ktime_t start = ktime_get(), locked;
+	int type = -1;		/* Command number, for the latency histograms */
+	int queued = 0;		/* Timed by move_work_fn() instead */
+	if (reply) {
+		reply[0] = '\0';
+	}
+
 	// Parse user input
 
-	mutex_lock(&d_mutex);
+	/* Without O_NONBLOCK wait for the game, but let a killed process
+	go instead of queueing behind a long search. With it, give up
+	while the game is busy computing */
+	int replied = 1;
+	if (nonblock) {
+		if (atomic_read(&cdev_data[d_num].pending) ||
+		    !mutex_trylock(&cdev_data[d_num].lock)) {
+			return -EAGAIN;
+		}
+		if (cdev_data[d_num].searching) {
+			mutex_unlock(&cdev_data[d_num].lock);
+			return -EAGAIN;
+		}
+		atomic_inc(&cdev_data[d_num].pending);
+	}
+	else {
+		atomic_inc(&cdev_data[d_num].pending);
+		if (mutex_lock_killable(&cdev_data[d_num].lock)) {
+			command_done(d_num);
+			return -EINTR;
+		}
+	}
+	locked = ktime_get();
+	// The reply of the previous command is replaced
+	WRITE_ONCE(cdev_data[d_num].read_seq, READ_ONCE(cdev_data[d_num].reply_seq));
+	// Whoever drives the game pays for its searches
+	cdev_data[d_num].uid = current_euid();
+	cdev_data[d_num].last_used = jiffies;
 
 	// Check if a newline character is present
 	int i;
@@ -1230,6 +3453,9 @@ static ssize_t d_write(struct file *filp, const char __user *buf,
 		strcpy(cdev_data[d_num].reply, err);
 		goto out;
 	}
+	if (cmd[0] == '0' && isdigit(cmd[1])) {
+		type = cmd[1] - '0';
+	}
 	/* The longest argument can be at most 10 characters long. */
 	if (arg && strlen(arg) > 13) {
 		char err[] = "INVFMT\n\0";
@@ -1247,11 +3473,16 @@ static ssize_t d_write(struct file *filp, const char __user *buf,
 		}
 		/* White goes first, occupies lower section of the board */
 		if (strcmp(arg, "W") == 0) {
+			stop_ponder(d_num);
+			reset_search(d_num);
+			set_game_node(d_num, numa_node_id());
+			set_game_memcg(d_num);
+			log_reset(d_num, NULL);
 			cdev_data[d_num].game_on = 1;
 			// Set up the game board
-			mutex_unlock(&d_mutex);
+			mutex_unlock(&cdev_data[d_num].lock);
 			set_board(d_num);
-			mutex_lock(&d_mutex);
+			mutex_lock(&cdev_data[d_num].lock);
 
 			cdev_data[d_num].player_color = 'W';
 			cdev_data[d_num].computer_color = 'B';
@@ -1261,11 +3492,16 @@ static ssize_t d_write(struct file *filp, const char __user *buf,
 		}
 		/* Black goes second, occupies upper portion of the board */
 		else if (strcmp(arg, "B") == 0) {
+			stop_ponder(d_num);
+			reset_search(d_num);
+			set_game_node(d_num, numa_node_id());
+			set_game_memcg(d_num);
+			log_reset(d_num, NULL);
 			cdev_data[d_num].game_on = 1;
 			// Set up the game board
-			mutex_unlock(&d_mutex);
+			mutex_unlock(&cdev_data[d_num].lock);
 			set_board(d_num);
-			mutex_lock(&d_mutex);
+			mutex_lock(&cdev_data[d_num].lock);
 
 			cdev_data[d_num].player_color = 'B';
 			cdev_data[d_num].computer_color = 'W';
@@ -1287,9 +3523,9 @@ static ssize_t d_write(struct file *filp, const char __user *buf,
 			strcpy(cdev_data[d_num].reply, err);
 			goto out;
 		}
-		mutex_unlock(&d_mutex);
-		display_board(d_num);
-		mutex_lock(&d_mutex);
+		// Normally answered by view_board() without the lock
+		memcpy(cdev_data[d_num].reply, cdev_data[d_num].snap_board,
+		       sizeof(cdev_data[d_num].reply));
 	}
 	/* 02 - User makes a move
 	 * takes 1 parameter - a move */
@@ -1301,6 +3537,12 @@ static ssize_t d_write(struct file *filp, const char __user *buf,
 			strcpy(cdev_data[d_num].reply, err);
 			goto out;
 		}
+		// "06" may be analysing this position with the lock dropped,
+		// let it finish before the board changes under it
+		if (wait_search(d_num)) {
+			command_done(d_num);
+			return -EINTR;
+		}
 		char color		= arg[0];
 		char type		= arg[1];
 		char source_letter	= arg[2];
@@ -1525,214 +3767,1052 @@ static ssize_t d_write(struct file *filp, const char __user *buf,
 					}
 				}
 
-				if (strlen(arg) == 10) {
-					piece_opt1.type = piece_opt.type;
-					piece_opt1.color = piece_opt.color;
-					piece_opt1.square.x = piece_opt.square.x;
-					piece_opt1.square.y = piece_opt.square.y;
-					color1 = color_opt;
-					type1 = type_opt;
-				}
-				else if (strlen(arg) == 13) {
-					piece_opt2.type = piece_opt.type;
-					piece_opt2.color = piece_opt.color;
-					piece_opt2.square.x = piece_opt.square.x;
-					piece_opt2.square.y = piece_opt.square.y;
-					color2 = color_opt;
-					type2 = type_opt;
-				}
+				if (strlen(arg) == 10) {
+					piece_opt1.type = piece_opt.type;
+					piece_opt1.color = piece_opt.color;
+					piece_opt1.square.x = piece_opt.square.x;
+					piece_opt1.square.y = piece_opt.square.y;
+					color1 = color_opt;
+					type1 = type_opt;
+				}
+				else if (strlen(arg) == 13) {
+					piece_opt2.type = piece_opt.type;
+					piece_opt2.color = piece_opt.color;
+					piece_opt2.square.x = piece_opt.square.x;
+					piece_opt2.square.y = piece_opt.square.y;
+					color2 = color_opt;
+					type2 = type_opt;
+				}
+
+				promote = 1;
+			}
+		}
+
+		// Check if the game is on
+		// NOGAME
+		if (cdev_data[d_num].game_on == 0) {
+			char err[] = "NOGAME\n\0";
+			strcpy(cdev_data[d_num].reply, err);
+			goto out;
+		}
+
+		// Check that it is player's turn
+		// OOT
+		if (cdev_data[d_num].turn != cdev_data[d_num].player_color) {
+			char err[] = "OOT\n\0";
+			strcpy(cdev_data[d_num].reply, err);
+			goto out;
+		}
+
+
+		// Check move for validity, valid will modify the board
+		// ILLMOVE or OK/CHECK/MATE
+		move_t valid = move_valid(&cdev_data[d_num].pos, piece, dest, take_piece, promote, piece_opt1, piece_opt2);
+		if (valid == NO_MOVE) {
+			char err[] = "ILLMOVE\n\0";
+			strcpy(cdev_data[d_num].reply, err);
+			goto out;
+		}
+		log_move(d_num, valid);
+		cdev_data[d_num].turn = cdev_data[d_num].computer_color;
+
+		// The ponder search guessed wrong, free the CPU
+		if (cdev_data[d_num].pondering &&
+		    cdev_data[d_num].ponder_key != cdev_data[d_num].pos.key) {
+			stop_ponder(d_num);
+		}
+
+		// Check if player has put CPU in check
+		int check = in_check(&cdev_data[d_num].pos, cdev_data[d_num].computer_color);
+		// Try to generate a valid CPU move: without one it is
+		// checkmate, or stalemate if the CPU is not in check
+		if (make_move(&cdev_data[d_num].pos, cdev_data[d_num].computer_color, 1)) {
+			stop_ponder(d_num);
+			game_stuck(d_num, cdev_data[d_num].computer_color);
+			goto out;
+		}
+		if (check) {
+			char reply[] = "CHECK\n\0";
+			strcpy(cdev_data[d_num].reply, reply);
+			goto out;
+		}
+		else {
+			char reply[] = "OK\n\0";
+			strcpy(cdev_data[d_num].reply, reply);
+			goto out;
+		}
+	}
+
+	/* 03 - Ask computer to make a move
+	 * doesn't take any arguments */
+	else if (strcmp(cmd, "03") == 0) {
+		if (arg == NULL) {
+			// Don't hold up a non-blocking caller: think in the
+			// background, the reply can be read (or polled) once it is ready
+			if (nonblock) {
+				queue_move_work(d_num, 3, info);
+				replied = 0;
+				queued = 1;
+				goto out;
+			}
+			// Another "03" is already thinking, wait for it to finish
+			if (wait_search(d_num)) {
+				command_done(d_num);
+				return -EINTR;
+			}
+			if (cpu_move(d_num)) {
+				replied = 0;
+			}
+			goto out;
+		}
+		else {
+			char err[] = "INVFMT\n\0";
+			strcpy(cdev_data[d_num].reply, err);
+			goto out;
+		}
+	}
+	/* Resign the game, declare computer a winner
+	Doesn't take any arguments */
+	else if (strcmp(cmd, "04") == 0) {
+		if (arg == NULL) {
+			// Not while "06" analyses the game
+			if (wait_search(d_num)) {
+				command_done(d_num);
+				return -EINTR;
+			}
+			if (cdev_data[d_num].game_on != 1) {
+				char err[] = "NOGAME\n\0";
+				strcpy(cdev_data[d_num].reply, err);
+				goto out;
+			}
+			if (cdev_data[d_num].turn != cdev_data[d_num].player_color) {
+				char err[] = "OOT\n\0";
+				strcpy(cdev_data[d_num].reply, err);
+				goto out;
+			}
+			stop_ponder(d_num);
+			cdev_data[d_num].game_on = 0;
+			set_result(d_num, cdev_data[d_num].computer_color);
+			char resp[] = "OK\n\0";
+			strcpy(cdev_data[d_num].reply, resp);
+		}
+		else {
+			char err[] = "INVFMT\n\0";
+			strcpy(cdev_data[d_num].reply, err);
+			goto out;
+		}
+	}
+	/* 05 - Set an engine option for this game
+	 * takes 1 argument of the form name=value,
+	 * "ponder=1" thinks on the player's time,
+	 * "time=N" gives each CPU move N ms (0 for no limit),
+	 * "nullmove", "lmr", "pvs" and "aspiration" (=0/1) switch
+	 * search features */
+	else if (strcmp(cmd, "05") == 0) {
+		if (arg == NULL || set_option(d_num, arg)) {
+			char err[] = "INVFMT\n\0";
+			strcpy(cdev_data[d_num].reply, err);
+			goto out;
+		}
+		char resp[] = "OK\n\0";
+		strcpy(cdev_data[d_num].reply, resp);
+	}
+	/* 06 - Analyse the current position
+	 * takes 1 argument: the number of best moves to show (1 to 5).
+	 * Replies "DEPTH d", then one line per move in the notation of "02"
+	 * with its score in centipawns for the side to move */
+	else if (strcmp(cmd, "06") == 0) {
+		int n_pv;
+		if (arg == NULL || kstrtoint(arg, 10, &n_pv) || n_pv < 1 || n_pv > MAX_PV) {
+			char err[] = "INVFMT\n\0";
+			strcpy(cdev_data[d_num].reply, err);
+			goto out;
+		}
+		if (nonblock) {
+			cdev_data[d_num].work_arg[0] = n_pv;
+			queue_move_work(d_num, 6, info);
+			replied = 0;
+			queued = 1;
+			goto out;
+		}
+		if (wait_search(d_num)) {
+			command_done(d_num);
+			return -EINTR;
+		}
+		if (analyse(d_num, n_pv)) {
+			replied = 0;
+		}
+		goto out;
+	}
+	/* 07 - Let the engine play against itself
+	 * takes 1 argument: the number of games, optionally followed by
+	 * ",N" to end a game after N plies (200 by default). Moves are
+	 * searched as "03" does. Replies with the games per second, the
+	 * results and the average nodes searched per move */
+	else if (strcmp(cmd, "07") == 0) {
+		int games, plies = SELF_PLAY_PLIES;
+		char *limit = arg ? strchr(arg, ',') : NULL;
+		if (limit) {
+			*limit++ = '\0';
+		}
+		if (arg == NULL || kstrtoint(arg, 10, &games) || games < 1 ||
+		    (limit && (kstrtoint(limit, 10, &plies) || plies < 1))) {
+			char err[] = "INVFMT\n\0";
+			strcpy(cdev_data[d_num].reply, err);
+			goto out;
+		}
+		if (nonblock) {
+			cdev_data[d_num].work_arg[0] = games;
+			cdev_data[d_num].work_arg[1] = plies;
+			queue_move_work(d_num, 7, info);
+			replied = 0;
+			queued = 1;
+			goto out;
+		}
+		if (wait_search(d_num)) {
+			command_done(d_num);
+			return -EINTR;
+		}
+		if (self_play(d_num, games, plies)) {
+			replied = 0;
+		}
+		goto out;
+	}
+	/* 08 - Benchmark the engine
+	 * takes an optional argument: the depth of the searches (8 by
+	 * default). Searches a fixed set of positions and replies with
+	 * the nodes, the time in ms, the nodes per second and a signature
+	 * of the node counts that changes whenever the search does */
+	else if (strcmp(cmd, "08") == 0) {
+		int depth = BENCH_DEPTH;
+		if (arg && (kstrtoint(arg, 10, &depth) || depth < 1 || depth > MAX_PLY - 1)) {
+			char err[] = "INVFMT\n\0";
+			strcpy(cdev_data[d_num].reply, err);
+			goto out;
+		}
+		if (nonblock) {
+			cdev_data[d_num].work_arg[0] = depth;
+			queue_move_work(d_num, 8, info);
+			replied = 0;
+			queued = 1;
+			goto out;
+		}
+		if (wait_search(d_num)) {
+			command_done(d_num);
+			return -EINTR;
+		}
+		if (bench(d_num, depth)) {
+			replied = 0;
+		}
+		goto out;
+	}
+	/* Unknown Command */
+	else {
+		char err[] = "UNKCMD\n\0";
+		strcpy(cdev_data[d_num].reply, err);
+		goto out;
+	}
+out:
+	if (reply && replied) {
+		memcpy(reply, cdev_data[d_num].reply, sizeof(cdev_data[d_num].reply));
+	}
+	publish(d_num, replied);
+	mutex_unlock(&cdev_data[d_num].lock);
+	command_done(d_num);
+	if (!queued) {
+		hist_record(type, start, locked, ktime_get());
+	}
+	return len;
+}
+
+/* Readable once a command has replied, writable while the game is
+ * not computing */
+static __poll_t d_poll(struct file *filp, poll_table *wait) {
+	int d_num = MINOR(filp->f_path.dentry->d_inode->i_rdev);
+	__poll_t mask = 0;
+
+	poll_wait(filp, &cdev_data[d_num].reply_wq, wait);
+	if (reply_ready(&cdev_data[d_num])) {
+		mask |= EPOLLIN | EPOLLRDNORM;
+	}
+	if (!atomic_read(&cdev_data[d_num].pending) &&
+	    !READ_ONCE(cdev_data[d_num].searching)) {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+	return mask;
+}
+
+static int d_open(struct inode *inode, struct file *file) {
+	int d_num = MINOR(inode->i_rdev);
+	mutex_lock(&cdev_data[d_num].lock);
+	++cdev_data[d_num].users;
+	mutex_unlock(&cdev_data[d_num].lock);
+	return 0;
+}
+
+static int d_release(struct inode *inode, struct file *file) {
+	int d_num = MINOR(inode->i_rdev);
+	mutex_lock(&cdev_data[d_num].lock);
+	// Nobody is left to play the predicted move, stop thinking about it
+	if (--cdev_data[d_num].users == 0) {
+		stop_ponder(d_num);
+	}
+	mutex_unlock(&cdev_data[d_num].lock);
+	return 0;
+}
+
+/* Reading /dev/chess-ctl gives an image of all the games in progress,
+ * writing the image back (e.g. after reloading the module) restores
+ * them. The image is little endian: a header, then a record per game. */
+struct image_header {
+	__le32 magic;		/* IMAGE_MAGIC */
+	__le16 version;		/* IMAGE_VERSION */
+	__le16 record_size;	/* sizeof(struct image_game) */
+	__le32 games;
+} __packed;
+
+struct image_game {
+	__le16 minor;
+	u8 turn;		/* W/B */
+	u8 player_color;
+	u8 ponder;
+	u8 features;
+	__le32 move_time;
+	u8 type[32];		/* Type of each figure, with CAPTURED */
+	u8 square[32];		/* 8 * y + x of each figure that is on the board */
+} __packed;
+
+/* What an open chess-ctl holds: the image being read or written */
+struct image_buf {
+	size_t len;
+	size_t size;
+	u8 data[];
+};
+
+// Take a snapshot of all games for a reader, take a buffer for a writer
+static int image_open(struct inode *inode, struct file *file) {
+	struct image_buf *img;
+	size_t size = sizeof(struct image_header) + devices * sizeof(struct image_game);
+	int i;
+
+	// The image goes one way at a time
+	if ((file->f_mode & FMODE_READ) && (file->f_mode & FMODE_WRITE)) {
+		return -EINVAL;
+	}
+	img = kvzalloc(sizeof(*img) + size, GFP_KERNEL);
+	if (!img) {
+		return -ENOMEM;
+	}
+	img->size = size;
+	file->private_data = img;
+	if (!(file->f_mode & FMODE_READ)) {
+		return 0;
+	}
+
+	struct image_header *h = (struct image_header *)img->data;
+	struct image_game *r = (struct image_game *)(h + 1);
+	u32 games = 0;
+	for (i = 0; i < devices; ++i) {
+		struct d_data *game = &cdev_data[i];
+		int k;
+		if (mutex_lock_killable(&game->lock)) {
+			kvfree(img);
+			return -EINTR;
+		}
+		if (game->game_on != 1) {
+			mutex_unlock(&game->lock);
+			continue;
+		}
+		r->minor = cpu_to_le16(i);
+		r->turn = game->turn;
+		r->player_color = game->player_color;
+		r->ponder = game->ponder;
+		r->features = game->features;
+		r->move_time = cpu_to_le32(game->move_time);
+		for (k = 0; k < 32; ++k) {
+			r->type[k] = game->pos.figures[k].type;
+			r->square[k] = ALIVE(game->pos.figures[k]) ?
+				       SQ(game->pos.figures[k].square) : 0;
+		}
+		mutex_unlock(&game->lock);
+		++r;
+		++games;
+	}
+	h->magic = cpu_to_le32(IMAGE_MAGIC);
+	h->version = cpu_to_le16(IMAGE_VERSION);
+	h->record_size = cpu_to_le16(sizeof(struct image_game));
+	h->games = cpu_to_le32(games);
+	img->len = (u8 *)r - img->data;
+	return 0;
+}
+
+static int image_release(struct inode *inode, struct file *file) {
+	kvfree(file->private_data);
+	return 0;
+}
+
+static ssize_t image_read(struct file *file, char __user *buf, size_t len, loff_t *offset) {
+	struct image_buf *img = file->private_data;
+	return simple_read_from_buffer(buf, len, offset, img->data, img->len);
+}
+
+/* Collect the image, which may come in several writes, and restore
+ * the games once it is complete. A bad image restores nothing. */
+static ssize_t image_write(struct file *file, const char __user *buf, size_t len, loff_t *offset) {
+	struct image_buf *img = file->private_data;
+	int err;
+
+	if (len > img->size - img->len) {
+		return -EFBIG;
+	}
+	if (copy_from_user(img->data + img->len, buf, len)) {
+		return -EFAULT;
+	}
+	img->len += len;
+	err = image_import(img);
+	return err ? err : len;
+}
+
+/* Restore the games of a complete image. Returns 0 if it is not
+ * complete yet, -EINVAL if it is not a valid image. */
+static int image_import(struct image_buf *img) {
+	struct image_header *h = (struct image_header *)img->data;
+	struct image_game *r = (struct image_game *)(h + 1);
+	bool seen[MAX_MINOR] = { false };	/* Minors named by the records so far */
+	position_t *pos;
+	u32 games, i;
+
+	if (img->len < sizeof(*h)) {
+		return 0;
+	}
+	if (le32_to_cpu(h->magic) != IMAGE_MAGIC || le16_to_cpu(h->version) != IMAGE_VERSION ||
+	    le16_to_cpu(h->record_size) != sizeof(*r) || le32_to_cpu(h->games) > devices) {
+		return -EINVAL;
+	}
+	games = le32_to_cpu(h->games);
+	if (img->len < sizeof(*h) + games * sizeof(*r)) {
+		return 0;
+	}
+	if (img->len > sizeof(*h) + games * sizeof(*r)) {
+		return -EINVAL;
+	}
+
+	// Check every game before touching any
+	pos = kmalloc(sizeof(*pos), GFP_KERNEL);
+	if (!pos) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < games; ++i) {
+		// A game may only be named once, or which record wins is a guess
+		if (image_load_game(&r[i], pos) || seen[le16_to_cpu(r[i].minor)]) {
+			kfree(pos);
+			return -EINVAL;
+		}
+		seen[le16_to_cpu(r[i].minor)] = true;
+	}
+	kfree(pos);
+	for (i = 0; i < games; ++i) {
+		image_restore_game(&r[i]);
+	}
+	// The image is used up, the next write starts a new one
+	img->len = 0;
+	return 0;
+}
+
+/* Set up the position of a game record in pos. Returns -EINVAL if the
+ * record is not a game we could be playing. */
+static int image_load_game(const struct image_game *r, position_t *pos) {
+	u8 kinds[2][N_LISTS] = { { 0 } };
+	int i;
+
+	if (le16_to_cpu(r->minor) >= devices ||
+	    (r->turn != 'W' && r->turn != 'B') ||
+	    (r->player_color != 'W' && r->player_color != 'B') ||
+	    r->ponder > 1 || (r->features & ~SEARCH_ALL) ||
+	    (s32)le32_to_cpu(r->move_time) < 0) {
+		return -EINVAL;
+	}
+	for (i = 0; i < 64; ++i) {
+		pos->board[i] = -1;
+	}
+	for (i = 0; i < 32; ++i) {
+		piece_t *p = &pos->figures[i];
+		int type = r->type[i] & ~CAPTURED;
+		int sq = r->square[i];
+
+		if (type != PAWN && type != ROOK && type != KNIGHT &&
+		    type != BISHOP && type != QUEEN && type != KING) {
+			return -EINVAL;
+		}
+		// Kings are never taken, and only the last figure of a side is one
+		if ((i % 16 == 15) != (r->type[i] == KING)) {
+			return -EINVAL;
+		}
+		p->type = r->type[i];
+		p->color = i < 16 ? 'W' : 'B';
+		p->square.x = 0;
+		p->square.y = 0;
+		if (!ALIVE(*p)) {
+			continue;
+		}
+		if (sq >= 64 || pos->board[sq] != -1 ||
+		    (type == PAWN && (sq < 8 || sq >= 56)) ||
+		    ++kinds[i / 16][list_of[type]] > LIST_SIZE) {
+			return -EINVAL;
+		}
+		p->square.x = sq % 8;
+		p->square.y = sq / 8;
+		pos->board[sq] = i;
+	}
+	init_position(pos, r->turn);
+	// The side that just moved cannot be in check, or its king could be taken
+	if (in_check(pos, r->turn == 'W' ? 'B' : 'W')) {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+// Replace a game with the one in a checked record
+static void image_restore_game(const struct image_game *r) {
+	int d_num = le16_to_cpu(r->minor);
+	struct d_data *game = &cdev_data[d_num];
+	char fen[FEN_SIZE];
+
+	mutex_lock(&game->lock);
+	// Whatever this game was thinking about is gone
+	stop_ponder(d_num);
+	reset_search(d_num);
+	// The game is the restoring task's now, as if it had sent "00"
+	set_game_node(d_num, numa_node_id());
+	set_game_memcg(d_num);
+	game->uid = current_euid();
+	game->last_used = jiffies;
+	image_load_game(r, &game->pos);
+	// The moves that led here are not in the image
+	position_fen(&game->pos, r->turn, fen);
+	log_reset(d_num, fen);
+	game->game_on = 1;
+	game->turn = r->turn;
+	game->player_color = r->player_color;
+	game->computer_color = r->player_color == 'W' ? 'B' : 'W';
+	game->ponder = r->ponder;
+	game->features = r->features;
+	game->move_time = le32_to_cpu(r->move_time);
+	publish(d_num, 0);
+	mutex_unlock(&game->lock);
+}
+
+static const struct file_operations image_fops = {
+	.owner	= THIS_MODULE,
+	.read	= image_read,
+	.write	= image_write,
+	.open	= image_open,
+	.release = image_release,
+	.llseek	= default_llseek,
+};
+
+static struct miscdevice image_dev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= "chess-ctl",
+	.fops	= &image_fops,
+	.mode	= 0600,
+};
+static bool image_registered;
+
+/* debugfs/chess/chess-N.pgn streams the game of device N as PGN, from a
+ * copy of its move log taken at open. Line 0 is the tag pairs, then
+ * one line per move number, then the result. */
+struct pgn_state {
+	int d_num;
+	move_t *log;
+	u32 len;
+	u8 log_full;
+	u8 result;
+	u8 self_play;
+	char player_color;
+	char *fen;		/* Starting position, NULL for the usual one */
+	position_t pos;		/* The game after the first `replayed` moves */
+	char turn;
+	u32 replayed;
+};
+
+static const char *const result_text[] = {
+	[RESULT_NONE] = "*", [RESULT_WHITE] = "1-0",
+	[RESULT_BLACK] = "0-1", [RESULT_DRAW] = "1/2-1/2",
+};
 
-				promote = 1;
-			}
-		}
+static struct dentry *chess_debugfs;
 
-		// Check if the game is on
-		// NOGAME
-		if (cdev_data[d_num].game_on == 0) {
-			char err[] = "NOGAME\n\0";
-			strcpy(cdev_data[d_num].reply, err);
-			goto out;
-		}
+// Lines of moves: move pairs, the first one has only black's if black starts
+static u32 pgn_lines(struct pgn_state *st) {
+	char first = st->fen ? st->fen[strlen(st->fen) - 1] : 'w';
+	if (first == 'b' && st->len) {
+		return 1 + DIV_ROUND_UP(st->len - 1, 2);
+	}
+	return DIV_ROUND_UP(st->len, 2);
+}
 
-		// Check that it is player's turn
-		// OOT
-		if (cdev_data[d_num].turn != cdev_data[d_num].player_color) {
-			char err[] = "OOT\n\0";
-			strcpy(cdev_data[d_num].reply, err);
-			goto out;
-		}
+// Bring st->pos to the position after the first n moves of the log
+static void pgn_seek(struct pgn_state *st, u32 n) {
+	struct undo_t u;
+	// Going back means starting over, which only happens when
+	// seq_file asks for a line again
+	if (st->replayed > n || st->replayed == 0) {
+		st->turn = load_position(&st->pos, st->fen ? st->fen : START_FEN);
+		st->replayed = 0;
+	}
+	for (; st->replayed < n; ++st->replayed) {
+		do_move(&st->pos, st->log[st->replayed], &u);
+		st->turn = st->turn == 'W' ? 'B' : 'W';
+	}
+}
 
+static void *pgn_start(struct seq_file *m, loff_t *pos) {
+	struct pgn_state *st = m->private;
+	return *pos <= pgn_lines(st) + 1 ? pos : NULL;
+}
 
-		// Check move for validity, valid will modify the board
-		// ILLMOVE or OK/CHECK/MATE
-		mutex_unlock(&d_mutex);
-		int valid = move_valid(d_num, piece, dest, take_piece, promote, piece_opt1, piece_opt2);
-		mutex_lock(&d_mutex);
-		if (!valid) {
-			char err[] = "ILLMOVE\n\0";
-			strcpy(cdev_data[d_num].reply, err);
-			goto out;
-		}
-		cdev_data[d_num].turn = cdev_data[d_num].computer_color;
+static void *pgn_next(struct seq_file *m, void *v, loff_t *pos) {
+	++*pos;
+	return pgn_start(m, pos);
+}
 
-		// Check if player has put CPU in check
-		mutex_unlock(&d_mutex);
-		int check = in_check(d_num, cdev_data[d_num].computer_color);
-		mutex_lock(&d_mutex);
-		if (check) {
-			// If check, check for checkmate:
-			// Try to generate a valid CPU move
-			mutex_unlock(&d_mutex);
-			int mate = make_move(d_num, cdev_data[d_num].computer_color, 1);
-			mutex_lock(&d_mutex);
-			// If there is no such move, it is checkmate
-			if (mate) {
-				// Checkmate == game over
-				cdev_data[d_num].game_on = 0;
-				char reply[] = "MATE\n\0";
-				strcpy(cdev_data[d_num].reply, reply);
-				goto out;
-			}
-			else {
-				char reply[] = "CHECK\n\0";
-				strcpy(cdev_data[d_num].reply, reply);
-				goto out;
-			}
+static void pgn_stop(struct seq_file *m, void *v) {
+}
+
+static int pgn_show(struct seq_file *m, void *v) {
+	struct pgn_state *st = m->private;
+	u32 line = *(loff_t *)v;
+	u32 lines = pgn_lines(st);
+	char san[16];
+
+	if (line == 0) {
+		const char *white = st->self_play || st->player_color != 'W' ? "CPU" : "Player";
+		const char *black = st->self_play || st->player_color != 'B' ? "CPU" : "Player";
+		seq_printf(m, "[Event \"kernel-chess\"]\n[Site \"chess-%d\"]\n"
+			   "[White \"%s\"]\n[Black \"%s\"]\n[Result \"%s\"]\n",
+			   st->d_num, white, black, result_text[st->result]);
+		if (st->fen) {
+			seq_printf(m, "[SetUp \"1\"]\n[FEN \"%s - - 0 1\"]\n", st->fen);
 		}
-		else {
-			char reply[] = "OK\n\0";
-			strcpy(cdev_data[d_num].reply, reply);
-			goto out;
+		seq_putc(m, '\n');
+		return 0;
+	}
+	if (line > lines) {
+		if (st->log_full) {
+			seq_puts(m, "{The rest of the game was not recorded} ");
 		}
+		seq_printf(m, "%s\n", result_text[st->result]);
+		return 0;
 	}
 
-	/* 03 - Ask computer to make a move
-	 * doesn't take any arguments */
-	else if (strcmp(cmd, "03") == 0) {
-		if (arg == NULL) {
-			if (cdev_data[d_num].game_on != 1) {
-				char err[] = "NOGAME\n\0";
-				strcpy(cdev_data[d_num].reply, err);
-				goto out;
-			}
-			if (cdev_data[d_num].turn != cdev_data[d_num].computer_color) {
-				char err[] = "OOT\n\0";
-				strcpy(cdev_data[d_num].reply, err);
-				goto out;
-			}
-			char resp[] = "OK\n\0";
-			strcpy(cdev_data[d_num].reply, resp);
-			/* Select a move to make - pick a random piece and
-			a random valid move with that piece */
-			// make_move returns 1 if there is a checkmate (should always return 0 in this case)
-			mutex_unlock(&d_mutex);
-			make_move(d_num, cdev_data[d_num].computer_color, 0);
-			mutex_lock(&d_mutex);
-			cdev_data[d_num].turn = cdev_data[d_num].player_color;
-
-			// Check of the CPU has put the player in check
-			mutex_unlock(&d_mutex);
-			int check = in_check(d_num, cdev_data[d_num].player_color);
-			mutex_lock(&d_mutex);
-			if (check) {
-				// If check, check for checkmate:
-				// Try to generate a valid player move
-				mutex_unlock(&d_mutex);
-				int mate = make_move(d_num, cdev_data[d_num].player_color, 1);
-				mutex_lock(&d_mutex);
-				// If there is no such move, it is checkmate
-				if (mate) {
-					cdev_data[d_num].game_on = 0;
-					char reply[] = "MATE\n\0";
-					strcpy(cdev_data[d_num].reply, reply);
-					goto out;
-				}
-				else {
-					char reply[] = "CHECK\n\0";
-					strcpy(cdev_data[d_num].reply, reply);
-					goto out;
+	// The first move of this line, black's if the game started with it
+	char first = st->fen ? st->fen[strlen(st->fen) - 1] : 'w';
+	u32 k = first == 'b' ? (line == 1 ? 0 : 2 * line - 3) : 2 * line - 2;
+	pgn_seek(st, k);
+	seq_printf(m, "%u.%s", line, st->turn == 'B' ? ".." : "");
+	do {
+		move_san(&st->pos, st->turn, st->log[k], san);
+		seq_printf(m, " %s", san);
+		pgn_seek(st, ++k);
+	} while (k < st->len && st->turn == 'B');
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static const struct seq_operations pgn_seq_ops = {
+	.start	= pgn_start,
+	.next	= pgn_next,
+	.stop	= pgn_stop,
+	.show	= pgn_show,
+};
+
+static int pgn_open(struct inode *inode, struct file *file) {
+	struct d_data *game = inode->i_private;
+	struct pgn_state *st;
+
+	st = __seq_open_private(file, &pgn_seq_ops, sizeof(*st));
+	if (!st) {
+		return -ENOMEM;
+	}
+	if (mutex_lock_killable(&game->lock)) {
+		seq_release_private(inode, file);
+		return -EINTR;
+	}
+	st->d_num = game - cdev_data;
+	st->len = game->log_len;
+	st->log_full = game->log_full;
+	st->result = game->result;
+	st->self_play = game->self_play;
+	st->player_color = game->player_color;
+	st->log = kvmalloc_array(max(st->len, 1U), sizeof(*st->log), GFP_KERNEL);
+	if (st->log && st->len) {
+		memcpy(st->log, game->log, st->len * sizeof(*st->log));
+	}
+	if (game->log_fen) {
+		st->fen = kstrdup(game->log_fen, GFP_KERNEL);
+	}
+	mutex_unlock(&game->lock);
+
+	if (!st->log || (game->log_fen && !st->fen)) {
+		kvfree(st->log);
+		kfree(st->fen);
+		seq_release_private(inode, file);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int pgn_release(struct inode *inode, struct file *file) {
+	struct pgn_state *st = ((struct seq_file *)file->private_data)->private;
+	kvfree(st->log);
+	kfree(st->fen);
+	return seq_release_private(inode, file);
+}
+
+static const struct file_operations pgn_fops = {
+	.owner	= THIS_MODULE,
+	.open	= pgn_open,
+	.read	= seq_read,
+	.llseek	= seq_lseek,
+	.release = pgn_release,
+};
+
+/* debugfs chess/latency: a line per command and phase (wait for the
+ * game lock, run, total) with the count, the p50/p99/p999/max upper
+ * bounds in ns and the non-empty buckets as "k:n", n times of 2^k to
+ * 2^(k+1) ns. Writing to it sets the counts back to zero. */
+static const char *const hist_phases[HIST_PHASES] = { "wait", "run", "total" };
+
+// Upper bound in ns of the bucket that holds the p-th per mille time
+static u64 hist_percentile(const u64 *n, u64 count, int p) {
+	u64 rank = div_u64(count * p + 999, 1000), seen = 0;
+	int k;
+	for (k = 0; k < HIST_BUCKETS - 1; ++k) {
+		seen += n[k];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return 2ULL << k;
+}
+
+static int latency_show(struct seq_file *m, void *v) {
+	u64 *n = kmalloc_array(HIST_BUCKETS, sizeof(*n), GFP_KERNEL);
+	int c, p, k, cpu;
+
+	if (!n) {
+		return -ENOMEM;
+	}
+	seq_puts(m, "cmd phase count p50_ns p99_ns p999_ns max_ns buckets\n");
+	for (c = 0; c < HIST_CMDS; ++c) {
+		for (p = 0; p < HIST_PHASES; ++p) {
+			u64 count = 0;
+			int top = 0;
+			memset(n, 0, HIST_BUCKETS * sizeof(*n));
+			for_each_possible_cpu(cpu) {
+				struct latency_hist *h = per_cpu_ptr(&latency_hist, cpu);
+				for (k = 0; k < HIST_BUCKETS; ++k) {
+					n[k] += READ_ONCE(h->n[c][p][k]);
 				}
 			}
-			else {
-				char reply[] = "OK\n\0";
-				strcpy(cdev_data[d_num].reply, reply);
-				goto out;
+			for (k = 0; k < HIST_BUCKETS; ++k) {
+				count += n[k];
+				if (n[k]) {
+					top = k;
+				}
 			}
-		}
-		else {
-			char err[] = "INVFMT\n\0";
-			strcpy(cdev_data[d_num].reply, err);
-			goto out;
-		}
-	}
-	/* Resign the game, declare computer a winner
-	Doesn't take any arguments */
-	else if (strcmp(cmd, "04") == 0) {
-		if (arg == NULL) {
-			if (cdev_data[d_num].game_on != 1) {
-				char err[] = "NOGAME\n\0";
-				strcpy(cdev_data[d_num].reply, err);
-				goto out;
+			if (!count) {
+				continue;
 			}
-			if (cdev_data[d_num].turn != cdev_data[d_num].player_color) {
-				char err[] = "OOT\n\0";
-				strcpy(cdev_data[d_num].reply, err);
-				goto out;
+			seq_printf(m, "0%d %s %llu %llu %llu %llu %llu", c, hist_phases[p], count,
+				   hist_percentile(n, count, 500), hist_percentile(n, count, 990),
+				   hist_percentile(n, count, 999), 2ULL << top);
+			for (k = 0; k < HIST_BUCKETS; ++k) {
+				if (n[k]) {
+					seq_printf(m, " %d:%llu", k, n[k]);
+				}
 			}
-			cdev_data[d_num].game_on = 0;
-			char resp[] = "OK\n\0";
-			strcpy(cdev_data[d_num].reply, resp);
-		}
-		else {
-			char err[] = "INVFMT\n\0";
-			strcpy(cdev_data[d_num].reply, err);
-			goto out;
+			seq_putc(m, '\n');
 		}
 	}
-	/* Unknown Command */
-	else {
-		char err[] = "UNKCMD\n\0";
-		strcpy(cdev_data[d_num].reply, err);
-		goto out;
+	kfree(n);
+	return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file) {
+	return single_open(file, latency_show, NULL);
+}
+
+// Start counting afresh. Commands finishing meanwhile may be kept or lost
+static ssize_t latency_write(struct file *file, const char __user *buf, size_t len, loff_t *offset) {
+	int cpu;
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(&latency_hist, cpu), 0, sizeof(struct latency_hist));
 	}
-out:
-	mutex_unlock(&d_mutex);
-	kfree(msg);
 	return len;
 }
 
-static int d_open(struct inode *inode, struct file *file) {
-	return 0;
+static const struct file_operations latency_fops = {
+	.owner	= THIS_MODULE,
+	.open	= latency_open,
+	.read	= seq_read,
+	.write	= latency_write,
+	.llseek	= seq_lseek,
+	.release = single_release,
+};
+
+/* /proc/chess lists every game, a line per device. It reads the fields
+ * without the game locks, so that monitoring never waits for a search
+ * or holds up a player; a line may mix values from before and after a
+ * command that is running. */
+static void *games_start(struct seq_file *m, loff_t *pos) {
+	if (*pos == 0) {
+		return SEQ_START_TOKEN;
+	}
+	return *pos <= devices ? &cdev_data[*pos - 1] : NULL;
 }
 
-static int d_release(struct inode *inode, struct file *file) {
+static void *games_next(struct seq_file *m, void *v, loff_t *pos) {
+	++*pos;
+	return games_start(m, pos);
+}
+
+static void games_stop(struct seq_file *m, void *v) {
+}
+
+static int games_show(struct seq_file *m, void *v) {
+	struct d_data *game = v;
+	size_t mem = 0;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_puts(m, "minor game_on turn player cpu moves searching pondering node memory\n");
+		return 0;
+	}
+	// Search memory, hash table and move log of the game in bytes
+	if (READ_ONCE(game->search)) {
+		mem += sizeof(struct search_t);
+	}
+	if (READ_ONCE(game->tt)) {
+		mem += (READ_ONCE(game->tt_mask) + 1) * sizeof(struct tt_entry);
+	}
+	mem += READ_ONCE(game->log_size) * sizeof(move_t);
+
+	u8 game_on = READ_ONCE(game->game_on);
+	seq_printf(m, "%d %u %c %c %c %u %u %u %d %zu\n", (int)(game - cdev_data), game_on,
+		   game_on ? READ_ONCE(game->turn) : '-',
+		   game_on ? READ_ONCE(game->player_color) : '-',
+		   game_on ? READ_ONCE(game->computer_color) : '-',
+		   READ_ONCE(game->log_len), READ_ONCE(game->searching),
+		   READ_ONCE(game->pondering), READ_ONCE(game->node), mem);
 	return 0;
 }
 
+static const struct seq_operations games_seq_ops = {
+	.start	= games_start,
+	.next	= games_next,
+	.stop	= games_stop,
+	.show	= games_show,
+};
+
+/* Generic netlink family, see chess-netlink.h. Its requests run as
+ * writes with O_NONBLOCK do, so a busy game never stalls the socket. */
+static const struct nla_policy nl_policy[CHESS_ATTR_MAX + 1] = {
+	[CHESS_ATTR_GAME]	= { .type = NLA_U32 },
+	[CHESS_ATTR_ARG]	= { .type = NLA_NUL_STRING, .len = 13 },
+};
+
+static struct genl_family nl_family;
+static bool nl_registered;
+
+// Command each request runs, indexed by CHESS_CMD_*
+static const char *nl_commands[__CHESS_CMD_MAX] = {
+	[CHESS_CMD_NEW]		= "00",
+	[CHESS_CMD_MOVE]	= "02",
+	[CHESS_CMD_CPU_MOVE]	= "03",
+	[CHESS_CMD_RESIGN]	= "04",
+};
+
+// Send a reply of game d_num to a netlink socket
+static int nl_send(u32 portid, u32 seq, int d_num, const char *text) {
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = genlmsg_new(nla_total_size(sizeof(u32)) + nla_total_size(strlen(text) + 1),
+			  GFP_KERNEL);
+	if (!skb) {
+		return -ENOMEM;
+	}
+	hdr = genlmsg_put(skb, portid, seq, &nl_family, 0, CHESS_CMD_REPLY);
+	if (!hdr || nla_put_u32(skb, CHESS_ATTR_GAME, d_num) ||
+	    nla_put_string(skb, CHESS_ATTR_REPLY, text)) {
+		nlmsg_free(skb);
+		return -EMSGSIZE;
+	}
+	genlmsg_end(skb, hdr);
+	return genlmsg_unicast(&init_net, skb, portid);
+}
+
+static int nl_doit(struct sk_buff *skb, struct genl_info *info) {
+	u8 cmd = info->genlhdr->cmd;
+	char reply[sizeof(cdev_data[0].reply)];
+	char msg[24];
+	const char *arg = NULL;
+	u32 d_num;
+	ssize_t ret;
+
+	if (!info->attrs[CHESS_ATTR_GAME]) {
+		GENL_SET_ERR_MSG(info, "no game");
+		return -EINVAL;
+	}
+	d_num = nla_get_u32(info->attrs[CHESS_ATTR_GAME]);
+	if (d_num >= devices) {
+		GENL_SET_ERR_MSG(info, "no such game");
+		return -ENODEV;
+	}
+	if (info->attrs[CHESS_ATTR_ARG]) {
+		arg = nla_data(info->attrs[CHESS_ATTR_ARG]);
+	}
+	// Only "00" and "02" take an argument, a single word
+	if ((cmd == CHESS_CMD_NEW || cmd == CHESS_CMD_MOVE) != (arg != NULL) ||
+	    (arg && (!*arg || strpbrk(arg, " \n")))) {
+		GENL_SET_ERR_MSG(info, "bad argument");
+		return -EINVAL;
+	}
+
+	// The last published board, without the game lock, like "01" on the device
+	if (cmd == CHESS_CMD_VIEW) {
+		struct d_data *game = &cdev_data[d_num];
+		ktime_t start = ktime_get();
+		unsigned int snap;
+		do {
+			snap = read_seqbegin(&game->snap_lock);
+			memcpy(reply, game->snap_board, sizeof(reply));
+		} while (read_seqretry(&game->snap_lock, snap));
+		hist_record(1, start, start, ktime_get());
+		return nl_send(info->snd_portid, info->snd_seq, d_num, reply);
+	}
+
+	snprintf(msg, sizeof(msg), "%s%s%s\n", nl_commands[cmd], arg ? " " : "", arg ? arg : "");
+	ret = run_command(d_num, msg, strlen(msg), 1, info, reply);
+	if (ret < 0) {
+		return ret;
+	}
+	// A CPU move replies from move_work_fn() once it is made
+	if (!reply[0]) {
+		return 0;
+	}
+	return nl_send(info->snd_portid, info->snd_seq, d_num, reply);
+}
+
+static const struct genl_small_ops nl_ops[] = {
+	{ .cmd = CHESS_CMD_NEW,		.doit = nl_doit },
+	{ .cmd = CHESS_CMD_VIEW,	.doit = nl_doit },
+	{ .cmd = CHESS_CMD_MOVE,	.doit = nl_doit },
+	{ .cmd = CHESS_CMD_CPU_MOVE,	.doit = nl_doit },
+	{ .cmd = CHESS_CMD_RESIGN,	.doit = nl_doit },
+};
+
+static struct genl_family nl_family __ro_after_init = {
+	.name		= CHESS_GENL_NAME,
+	.version	= CHESS_GENL_VERSION,
+	.maxattr	= CHESS_ATTR_MAX,
+	.policy		= nl_policy,
+	.parallel_ops	= true,	/* Requests of different games run side by side */
+	.module		= THIS_MODULE,
+	.small_ops	= nl_ops,
+	.n_small_ops	= ARRAY_SIZE(nl_ops),
+};
+
 static int __init chess_init(void) {
 	/* Register the device */
 	int error;
 	dev_t dev;
 
-	error = alloc_chrdev_region(&dev, 0, MAX_MINOR, DEVICE_NAME);
+	if (devices < 1 || devices > MAX_MINOR) {
+		pr_err("chess: devices must be 1 to %d\n", MAX_MINOR);
+		return -EINVAL;
+	}
+	error = alloc_chrdev_region(&dev, 0, devices, DEVICE_NAME);
 	major = MAJOR(dev);
 
 	cdev_class = class_create(THIS_MODULE, DEVICE_NAME);
 	cdev_class->dev_uevent = cdev_uevent;
 
+	chess_wq = alloc_workqueue("chess", WQ_UNBOUND, 0);
+	if (!chess_wq) {
+		return -ENOMEM;
+	}
+	if (pool_start()) {
+		pool_stop();
+		destroy_workqueue(chess_wq);
+		return -ENOMEM;
+	}
+	init_zobrist();
+	init_tables();
+
 	int i;
-	for (i = 0; i < MAX_MINOR; ++i) {
+	for (i = 0; i < devices; ++i) {
+		mutex_init(&cdev_data[i].lock);
+		init_waitqueue_head(&cdev_data[i].wq);
+		init_waitqueue_head(&cdev_data[i].reply_wq);
+		atomic_set(&cdev_data[i].pending, 0);
 		cdev_init(&cdev_data[i].cdev, &fops);
 		cdev_data[i].cdev.owner = THIS_MODULE;
 		cdev_add(&cdev_data[i].cdev, MKDEV(major, i), 1);
 
 		// Change "chess-%d" to "chess" here to run in the simulator!
-		device_create(cdev_class, NULL, MKDEV(major, i), NULL, "chess-%d", i);
+		device_create_with_groups(cdev_class, NULL, MKDEV(major, i), &cdev_data[i],
+					  chess_groups, "chess-%d", i);
 
 		cdev_data[i].turn = 'W';	/* White goes first */
 		cdev_data[i].game_on = 0;	/* Game not started yet */
+		cdev_data[i].ponder = ponder;
+		cdev_data[i].move_time = move_time;
+		cdev_data[i].features = SEARCH_ALL;
+		cdev_data[i].node = NUMA_NO_NODE;
+		cdev_data[i].budget_start = jiffies;
+		init_completion(&cdev_data[i].ponder_job.done);
+		INIT_WORK(&cdev_data[i].move_work, move_work_fn);
 		char msg[] = "NOMSG\n\0";
-		strcpy(cdev_data[i].reply, msg);
+		strcpy(cdev_data[i].snap_reply, msg);
+		seqlock_init(&cdev_data[i].snap_lock);
+		cdev_data[i].read_seq = ULONG_MAX;	/* "NOMSG" not read yet */
+		display_board(i);
+	}
+	// Debugging aids, the module works without them
+	proc_create_seq("chess", 0444, NULL, &games_seq_ops);
+	chess_debugfs = debugfs_create_dir("chess", NULL);
+	for (i = 0; i < devices; ++i) {
+		char name[32];
+		snprintf(name, sizeof(name), "chess-%d.pgn", i);
+		debugfs_create_file(name, 0444, chess_debugfs, &cdev_data[i], &pgn_fops);
+	}
+	debugfs_create_file("latency", 0644, chess_debugfs, NULL, &latency_fops);
+	// The games can be played without it, only snapshots are lost
+	if (misc_register(&image_dev)) {
+		pr_warn("chess: no chess-ctl, games cannot be saved\n");
+	}
+	else {
+		image_registered = true;
+	}
+	// Without it idle games keep their memory
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	if (register_shrinker(&chess_shrinker, "chess")) {
+#else
+	if (register_shrinker(&chess_shrinker)) {
+#endif
+		pr_warn("chess: no shrinker, idle games keep their search memory\n");
+	}
+	else {
+		shrinker_registered = true;
+	}
+	// Games are played through the devices without it
+	if (genl_register_family(&nl_family)) {
+		pr_warn("chess: no generic netlink family\n");
+	}
+	else {
+		nl_registered = true;
 	}
 	return 0;
 }
@@ -1740,15 +4820,231 @@ static int __init chess_init(void) {
 static void __exit chess_exit(void) {
 	/* Clean up by unregistering the device */
 	int i;
-	for (i = 0; i < MAX_MINOR; ++i) {
+	if (image_registered) {
+		misc_deregister(&image_dev);
+	}
+	// No new requests, a queued CPU move may still reply
+	if (nl_registered) {
+		genl_unregister_family(&nl_family);
+	}
+	if (shrinker_registered) {
+		unregister_shrinker(&chess_shrinker);
+	}
+	debugfs_remove_recursive(chess_debugfs);
+	remove_proc_entry("chess", NULL);
+	for (i = 0; i < devices; ++i) {
 		device_destroy(cdev_class, MKDEV(major, i));
+		flush_work(&cdev_data[i].move_work);
+		stop_ponder(i);
+		kvfree(cdev_data[i].search);
+		kvfree(cdev_data[i].tt);
+		kfree(cdev_data[i].log);
+		kfree(cdev_data[i].log_fen);
+		mem_cgroup_put(cdev_data[i].memcg);
 	}
+	destroy_workqueue(chess_wq);
+	pool_stop();
 
 	class_unregister(cdev_class);
 	class_destroy(cdev_class);
 
-	unregister_chrdev_region(MKDEV(major, 0), MINORMASK);
+	unregister_chrdev_region(MKDEV(major, 0), devices);
+}
+
+#if IS_ENABLED(CONFIG_KUNIT)
+#include <kunit/test.h>
+
+/* Regression tests of the move generator and the mate detection.
+ * Built when the kernel has CONFIG_KUNIT, they run when the module is
+ * loaded (e.g. in a UML or QEMU kernel) and report in the kernel log. */
+
+// Count the leaves of the legal move tree, depth plies deep
+static u64 perft(position_t *pos, char color, int depth) {
+	move_t moves[MAX_MOVES];
+	struct undo_t u;
+	u64 nodes = 0;
+	int n = gen_moves(pos, color, moves);
+	int k;
+	for (k = 0; k < n; ++k) {
+		do_move(pos, moves[k], &u);
+		if (!in_check(pos, color)) {
+			nodes += depth > 1 ? perft(pos, color == 'W' ? 'B' : 'W', depth - 1) : 1;
+		}
+		undo_move(pos, &u);
+	}
+	return nodes;
+}
+
+static piece_t test_piece(char color, int type, int x, int y) {
+	piece_t p = { .type = type, .color = color, .square = { x, y } };
+	return p;
+}
+
+static coord_t test_square(int x, int y) {
+	coord_t c = { x, y };
+	return c;
+}
+
+static void chess_test_load(struct kunit *test) {
+	position_t pos;
+
+	KUNIT_EXPECT_EQ(test, load_position(&pos, START_FEN), 'W');
+	KUNIT_EXPECT_EQ(test, pos.count[0][L_PAWN], 8);
+	KUNIT_EXPECT_EQ(test, pos.count[1][L_KING], 1);
+	KUNIT_EXPECT_EQ(test, load_position(&pos, "4k3/8/8/8/8/8/8/4K3 b"), 'B');
+	// No white king, a pawn on the last rank, a short rank, no side to move
+	KUNIT_EXPECT_EQ(test, load_position(&pos, "4k3/8/8/8/8/8/8/8 w"), 0);
+	KUNIT_EXPECT_EQ(test, load_position(&pos, "P3k3/8/8/8/8/8/8/4K3 w"), 0);
+	KUNIT_EXPECT_EQ(test, load_position(&pos, "4k3/8/8/8/8/8/7/4K3 w"), 0);
+	KUNIT_EXPECT_EQ(test, load_position(&pos, "4k3/8/8/8/8/8/8/4K3"), 0);
+}
+
+static const struct {
+	const char *fen;
+	int depth;
+	u64 nodes;
+} perft_cases[] = {
+	{ START_FEN, 1, 20 },
+	{ START_FEN, 2, 400 },
+	{ START_FEN, 3, 8902 },
+	{ START_FEN, 4, 197281 },
+	// Promotions with and without captures, for both colors
+	{ "n1n5/PPPk4/8/8/8/8/4Kppp/5N1N b", 1, 24 },
+	{ "n1n5/PPPk4/8/8/8/8/4Kppp/5N1N b", 2, 496 },
+	{ "n1n5/PPPk4/8/8/8/8/4Kppp/5N1N b", 3, 9483 },
+	// Pawns on the edge files must not capture around the board
+	{ "7k/8/8/8/n7/8/7P/K7 w", 1, 4 },
+	{ "7k/8/8/8/8/8/P6n/K7 w", 1, 4 },
+	{ "k7/N6p/8/8/8/8/8/7K b", 1, 5 },
+};
+
+static void chess_test_perft(struct kunit *test) {
+	position_t pos;
+	int i;
+	for (i = 0; i < ARRAY_SIZE(perft_cases); ++i) {
+		char turn = load_position(&pos, perft_cases[i].fen);
+		KUNIT_ASSERT_NE(test, turn, 0);
+		u64 key = pos.key;
+		KUNIT_EXPECT_EQ_MSG(test, perft(&pos, turn, perft_cases[i].depth),
+				    perft_cases[i].nodes, "%s depth %d",
+				    perft_cases[i].fen, perft_cases[i].depth);
+		KUNIT_EXPECT_EQ(test, pos.key, key);
+	}
+}
+
+static const struct {
+	const char *fen;
+	int check;
+	int no_moves;
+} mate_cases[] = {
+	{ START_FEN, 0, 0 },
+	{ "4k3/8/8/8/8/8/8/4R1K1 b", 1, 0 },	/* Check */
+	{ "rnb1kbnr/pppp1ppp/8/4p3/6Pq/5P2/PPPPP2P/RNBQKBNR w", 1, 1 },	/* Fool's mate */
+	{ "R5k1/5ppp/8/8/8/8/8/6K1 b", 1, 1 },	/* Back rank mate */
+	{ "6rk/5Npp/8/8/8/8/8/6K1 b", 1, 1 },	/* Smothered mate */
+	{ "7k/5Q2/6K1/8/8/8/8/8 b", 0, 1 },	/* Stalemate */
+};
+
+static void chess_test_mate(struct kunit *test) {
+	position_t pos;
+	int i;
+	for (i = 0; i < ARRAY_SIZE(mate_cases); ++i) {
+		char turn = load_position(&pos, mate_cases[i].fen);
+		KUNIT_ASSERT_NE(test, turn, 0);
+		u64 key = pos.key;
+		KUNIT_EXPECT_EQ_MSG(test, in_check(&pos, turn), mate_cases[i].check,
+				    "%s", mate_cases[i].fen);
+		KUNIT_EXPECT_EQ_MSG(test, make_move(&pos, turn, 1), mate_cases[i].no_moves,
+				    "%s", mate_cases[i].fen);
+		KUNIT_EXPECT_EQ(test, pos.key, key);
+	}
+}
+
+// A promotion taken back leaves the position as it was
+static void chess_test_promotion(struct kunit *test) {
+	static const u8 promo[] = { QUEEN, ROOK, BISHOP, KNIGHT };
+	position_t pos, orig;
+	struct undo_t u;
+	int i;
+
+	KUNIT_ASSERT_EQ(test, load_position(&pos, "1r5k/P7/8/8/8/8/8/K7 w"), 'W');
+	orig = pos;
+	for (i = 0; i < ARRAY_SIZE(promo); ++i) {
+		// a7-a8 and a7xb8
+		int to;
+		for (to = 56; to <= 57; ++to) {
+			do_move(&pos, MOVE(48, to, promo[i]), &u);
+			KUNIT_EXPECT_EQ(test, pos.figures[pos.board[to]].type, promo[i]);
+			KUNIT_EXPECT_EQ(test, pos.count[0][L_PAWN], 0);
+			KUNIT_EXPECT_EQ(test, pos.count[0][list_of[promo[i]]],
+					orig.count[0][list_of[promo[i]]] + 1);
+			KUNIT_EXPECT_EQ(test, pos.count[1][L_ROOK], to == 57 ? 0 : 1);
+			undo_move(&pos, &u);
+			KUNIT_EXPECT_EQ(test, pos.key, orig.key);
+			KUNIT_EXPECT_EQ(test, pos.occ[0], orig.occ[0]);
+			KUNIT_EXPECT_EQ(test, pos.occ[1], orig.occ[1]);
+			KUNIT_EXPECT_TRUE(test, !memcmp(pos.board, orig.board, sizeof(pos.board)));
+			KUNIT_EXPECT_TRUE(test, !memcmp(pos.figures, orig.figures, sizeof(pos.figures)));
+			KUNIT_EXPECT_TRUE(test, !memcmp(pos.count, orig.count, sizeof(pos.count)));
+		}
+	}
+
+	// The player has to name the piece, and the piece taken on the way
+	piece_t pawn = test_piece('W', PAWN, 0, 6);
+	piece_t none = test_piece('W', PAWN, 0, 0);
+	KUNIT_EXPECT_EQ(test, move_valid(&pos, pawn, test_square(0, 7), 0, 0, none, none), NO_MOVE);
+	KUNIT_EXPECT_EQ(test, move_valid(&pos, pawn, test_square(1, 7), 0, 1, none,
+					 test_piece('W', QUEEN, 1, 7)), NO_MOVE);
+	KUNIT_EXPECT_EQ(test, move_valid(&pos, pawn, test_square(1, 7), 1, 1,
+					 test_piece('B', KNIGHT, 1, 7),
+					 test_piece('W', QUEEN, 1, 7)), NO_MOVE);
+	KUNIT_EXPECT_EQ(test, move_valid(&pos, pawn, test_square(1, 7), 1, 1,
+					 test_piece('B', ROOK, 1, 7),
+					 test_piece('W', KNIGHT, 1, 7)), MOVE(48, 57, KNIGHT));
+	KUNIT_EXPECT_EQ(test, pos.figures[pos.board[57]].type, KNIGHT);
+	KUNIT_EXPECT_EQ(test, pos.count[1][L_ROOK], 0);
+	KUNIT_EXPECT_EQ(test, pos.count[0][L_KNIGHT], 1);
+}
+
+static void chess_test_capture(struct kunit *test) {
+	position_t pos;
+	piece_t pawn = test_piece('W', PAWN, 4, 3);
+	piece_t none = test_piece('W', PAWN, 0, 0);
+
+	KUNIT_ASSERT_EQ(test, load_position(&pos, "4k3/8/8/3p4/4P3/8/8/4K3 w"), 'W');
+	// e4xd5 needs the captured piece, of the right type
+	KUNIT_EXPECT_EQ(test, move_valid(&pos, pawn, test_square(3, 4), 0, 0, none, none), NO_MOVE);
+	KUNIT_EXPECT_EQ(test, move_valid(&pos, pawn, test_square(3, 4), 1, 0,
+					 test_piece('B', KNIGHT, 3, 4), none), NO_MOVE);
+	KUNIT_EXPECT_EQ(test, move_valid(&pos, pawn, test_square(3, 4), 1, 0,
+					 test_piece('B', PAWN, 3, 4), none), MOVE(28, 35, 0));
+	KUNIT_EXPECT_EQ(test, pos.count[1][L_PAWN], 0);
+	KUNIT_EXPECT_EQ(test, pos.occ[1], BIT_ULL(60));
+	KUNIT_EXPECT_EQ(test, pos.occ[0], BIT_ULL(4) | BIT_ULL(35));
+
+	// A pinned piece may not capture
+	KUNIT_ASSERT_EQ(test, load_position(&pos, "4k3/4r3/8/3p4/4Q3/8/8/4K3 w"), 'W');
+	KUNIT_EXPECT_EQ(test, move_valid(&pos, test_piece('W', QUEEN, 4, 3), test_square(3, 4),
+					 1, 0, test_piece('B', PAWN, 3, 4), none), NO_MOVE);
+	KUNIT_EXPECT_EQ(test, move_valid(&pos, test_piece('W', QUEEN, 4, 3), test_square(4, 6),
+					 1, 0, test_piece('B', ROOK, 4, 6), none), MOVE(28, 52, 0));
 }
 
+static struct kunit_case chess_test_cases[] = {
+	KUNIT_CASE(chess_test_load),
+	KUNIT_CASE(chess_test_perft),
+	KUNIT_CASE(chess_test_mate),
+	KUNIT_CASE(chess_test_promotion),
+	KUNIT_CASE(chess_test_capture),
+	{}
+};
+
+static struct kunit_suite chess_test_suite = {
+	.name = "chess",
+	.test_cases = chess_test_cases,
+};
+kunit_test_suite(chess_test_suite);
+#endif
+
 module_init(chess_init);
 module_exit(chess_exit);